@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Unbounded FIFO shared between a producer and consumer threads.
+// pop() blocks until an item arrives or the queue is closed and drained.
+
+template <class _Type> class BlockingQueue
+{
+public:
+    void push(_Type const &item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _items.push_back(item);
+        }
+        _ready.notify_one();
+    }
+
+    bool pop(_Type &item)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this] { return !_items.empty() || _closed; });
+
+        if (_items.empty())
+        {
+            return false;
+        }
+
+        item = _items.front();
+        _items.pop_front();
+        return true;
+    }
+
+    bool tryPop(_Type &item)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_items.empty())
+        {
+            return false;
+        }
+
+        item = _items.front();
+        _items.pop_front();
+        return true;
+    }
+
+    // wakes every waiting pop() once the remaining items are gone
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+        }
+        _ready.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::deque<_Type> _items;
+    bool _closed = false;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdint.h>
+#include <wctype.h>
+
+#include <string>
+#include <vector>
+
+#include "NameKernels.h"
+
+// Case folding used for extensions, ASCII without a library call
+inline wchar_t foldExtensionChar(wchar_t c)
+{
+    if (c < 0x80)
+    {
+        return (c >= L'A' && c <= L'Z') ? wchar_t(c + (L'a' - L'A')) : c;
+    }
+    return wchar_t(towlower(c));
+}
+
+// index of the first character after the last dot, length if the name has no dot
+inline uint32_t extensionStart(wchar_t const *name, uint32_t length)
+{
+    size_t dot = nameKernels().findLastDot(name, length);
+    return dot == NAME_NOT_FOUND ? length : uint32_t(dot + 1);
+}
+
+// Set of case folded extensions, each with a slot number.
+// Lookups fold and hash the characters in place and compare them against the stored
+// keys, so matching a file name never touches the heap. Only adding a new extension
+// allocates. Open addressing, the table is kept at most half full.
+
+class ExtensionTable
+{
+public:
+    static const uint32_t NOT_FOUND = 0xffffffff;
+
+    ExtensionTable()
+    {
+        _table.assign(64, 0);
+    }
+
+    // slot of the extension of a file name, "" for a name without a dot
+    uint32_t findFileName(wchar_t const *name, uint32_t length) const
+    {
+        uint32_t start = extensionStart(name, length);
+        return find(name + start, length - start);
+    }
+
+    uint32_t addFileName(wchar_t const *name, uint32_t length)
+    {
+        uint32_t start = extensionStart(name, length);
+        return add(name + start, length - start);
+    }
+
+    uint32_t find(wchar_t const *extension, uint32_t length) const
+    {
+        uint32_t mask = uint32_t(_table.size() - 1);
+
+        for (uint32_t i = _hash(extension, length) & mask;; i = (i + 1) & mask)
+        {
+            uint32_t entry = _table[i];
+            if (entry == 0)
+            {
+                return NOT_FOUND;
+            }
+            if (_equal(_keys[entry - 1], extension, length))
+            {
+                return entry - 1;
+            }
+        }
+    }
+
+    uint32_t add(wchar_t const *extension, uint32_t length)
+    {
+        uint32_t mask = uint32_t(_table.size() - 1);
+        uint32_t i = _hash(extension, length) & mask;
+
+        for (;; i = (i + 1) & mask)
+        {
+            uint32_t entry = _table[i];
+            if (entry == 0)
+            {
+                break;
+            }
+            if (_equal(_keys[entry - 1], extension, length))
+            {
+                return entry - 1;
+            }
+        }
+
+        std::wstring key(length, L'\0');
+        for (uint32_t n = 0; n < length; n++)
+        {
+            key[n] = foldExtensionChar(extension[n]);
+        }
+
+        _keys.push_back(std::move(key));
+        _table[i] = uint32_t(_keys.size());
+
+        if (_keys.size() * 2 > _table.size())
+        {
+            _grow();
+        }
+
+        return uint32_t(_keys.size() - 1);
+    }
+
+    // folded extension of a slot
+    std::wstring const &key(uint32_t slot) const
+    {
+        return _keys[slot];
+    }
+
+    uint32_t size() const
+    {
+        return uint32_t(_keys.size());
+    }
+
+    void clear()
+    {
+        _keys.clear();
+        _table.assign(64, 0);
+    }
+
+private:
+    static uint32_t _hash(wchar_t const *extension, uint32_t length)
+    {
+        // FNV-1a over the folded characters
+        uint32_t h = 2166136261u;
+        for (uint32_t n = 0; n < length; n++)
+        {
+            h = (h ^ uint32_t(foldExtensionChar(extension[n]))) * 16777619u;
+        }
+        return h;
+    }
+
+    static bool _equal(std::wstring const &key, wchar_t const *extension, uint32_t length)
+    {
+        return key.length() == length && nameKernels().equalFolded(key.data(), extension, length);
+    }
+
+    void _grow()
+    {
+        _table.assign(_table.size() * 2, 0);
+        uint32_t mask = uint32_t(_table.size() - 1);
+
+        for (uint32_t slot = 0; slot < _keys.size(); slot++)
+        {
+            uint32_t i = _hash(_keys[slot].data(), uint32_t(_keys[slot].length())) & mask;
+            while (_table[i] != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            _table[i] = slot + 1;
+        }
+    }
+
+    std::vector<std::wstring> _keys;
+    std::vector<uint32_t> _table; // slot + 1, 0 for empty
+};
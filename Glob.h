@@ -0,0 +1,274 @@
+#pragma once
+
+#include <stdint.h>
+#include <wctype.h>
+
+#include <string>
+#include <vector>
+
+#include "ExtensionTable.h"
+
+// Wildcard pattern for file names: '*' matches any run of characters, '?' one character,
+// [abc], [a-z] and [!a-z] or [^a-z] one character of a class. A '[' without a closing ']'
+// is an ordinary character, and a reversed range such as [z-a] matches nothing.
+//
+// The pattern is compiled once into tokens, match() then runs straight on the names in
+// the disk's arena: nothing is copied or lowered per name, and a compiled pattern is
+// only read while matching, so one pattern can serve several threads.
+//
+// Compiled with a volume's $UpCase table, a case insensitive pattern is folded through it
+// and matched against names folded the same way, DiskHandle::foldedNames, as they are.
+
+class GlobPattern
+{
+public:
+    GlobPattern()
+    {
+    }
+
+    GlobPattern(wchar_t const *pattern, size_t length, bool caseSensitive = false, wchar_t const *upcase = nullptr)
+    {
+        compile(pattern, length, caseSensitive, upcase);
+    }
+
+    void compile(wchar_t const *pattern, size_t length, bool caseSensitive = false, wchar_t const *upcase = nullptr)
+    {
+        _caseSensitive = caseSensitive;
+        _foldedNames = !caseSensitive && upcase != nullptr;
+        _tokens.clear();
+        _text.clear();
+        _ranges.clear();
+        _minLength = 0;
+
+        size_t i = 0;
+        while (i < length)
+        {
+            wchar_t c = pattern[i];
+
+            if (c == L'*')
+            {
+                // runs of stars are one star
+                if (_tokens.empty() || _tokens.back().type != STAR)
+                {
+                    _tokens.push_back({STAR, 0, 0, 0, false});
+                }
+                i++;
+            }
+            else if (c == L'?')
+            {
+                _tokens.push_back({ANY, 0, 1, 0, false});
+                _minLength++;
+                i++;
+            }
+            else if (c == L'[' && _compileClass(pattern, length, &i))
+            {
+                _minLength++;
+            }
+            else
+            {
+                if (_tokens.empty() || _tokens.back().type != LITERAL)
+                {
+                    _tokens.push_back({LITERAL, uint32_t(_text.size()), 0, 0, false});
+                }
+                _text.push_back(_foldedNames ? upcase[uint16_t(c)] : _fold(c));
+                _tokens.back().length++;
+                _minLength++;
+                i++;
+            }
+        }
+    }
+
+    bool match(wchar_t const *name, size_t length) const
+    {
+        if (length < _minLength)
+        {
+            return false;
+        }
+
+        size_t t = 0;
+        size_t n = 0;
+
+        // the last star seen and where its match ends for now; on a mismatch the star
+        // takes one more character and the tokens after it are tried again
+        size_t starToken = NO_STAR;
+        size_t starEnd = 0;
+
+        while (n < length)
+        {
+            if (t < _tokens.size())
+            {
+                Token const &token = _tokens[t];
+
+                if (token.type == STAR)
+                {
+                    starToken = ++t;
+                    starEnd = n;
+                    continue;
+                }
+
+                if (token.length <= length - n && _matchToken(token, name + n))
+                {
+                    n += token.length;
+                    t++;
+                    continue;
+                }
+            }
+
+            if (starToken == NO_STAR)
+            {
+                return false;
+            }
+
+            t = starToken;
+            n = ++starEnd;
+        }
+
+        while (t < _tokens.size() && _tokens[t].type == STAR)
+        {
+            t++;
+        }
+        return t == _tokens.size();
+    }
+
+    bool empty() const
+    {
+        return _tokens.empty();
+    }
+
+private:
+    enum TokenType
+    {
+        LITERAL,
+        ANY,
+        CLASS,
+        STAR
+    };
+
+    struct Token
+    {
+        TokenType type;
+        uint32_t begin;  // LITERAL: into _text, CLASS: into _ranges
+        uint32_t length; // characters matched
+        uint32_t ranges; // CLASS: number of ranges
+        bool negated;
+    };
+
+    struct Range
+    {
+        wchar_t low;
+        wchar_t high;
+    };
+
+    static const size_t NO_STAR = size_t(-1);
+
+    // same folding as the extension index, unless the names come folded
+    wchar_t _fold(wchar_t c) const
+    {
+        return _caseSensitive || _foldedNames ? c : foldExtensionChar(c);
+    }
+
+    bool _compileClass(wchar_t const *pattern, size_t length, size_t *position)
+    {
+        size_t i = *position + 1;
+        bool negated = i < length && (pattern[i] == L'!' || pattern[i] == L'^');
+        if (negated)
+        {
+            i++;
+        }
+
+        Token token = {CLASS, uint32_t(_ranges.size()), 1, 0, negated};
+        size_t first = i;
+
+        // a ']' right after the opening bracket belongs to the class
+        while (i < length && (pattern[i] != L']' || i == first))
+        {
+            wchar_t low = pattern[i];
+            wchar_t high = low;
+
+            if (i + 2 < length && pattern[i + 1] == L'-' && pattern[i + 2] != L']')
+            {
+                high = pattern[i + 2];
+                i += 2;
+            }
+            i++;
+
+            // a reversed range like [c-a] is empty, as in fnmatch
+            if (high < low)
+            {
+                continue;
+            }
+
+            _ranges.push_back({low, high});
+            token.ranges++;
+        }
+
+        if (i >= length)
+        {
+            // no closing bracket, the '[' is a literal
+            _ranges.resize(token.begin);
+            return false;
+        }
+
+        _tokens.push_back(token);
+        *position = i + 1;
+        return true;
+    }
+
+    bool _inClass(Token const &token, wchar_t c) const
+    {
+        for (uint32_t r = token.begin; r < token.begin + token.ranges; r++)
+        {
+            Range const &range = _ranges[r];
+            if (c >= range.low && c <= range.high)
+            {
+                return true;
+            }
+            if (!_caseSensitive)
+            {
+                wchar_t lower = foldExtensionChar(c);
+                wchar_t upper = wchar_t(towupper(c));
+                if ((lower >= range.low && lower <= range.high) || (upper >= range.low && upper <= range.high))
+                {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool _matchToken(Token const &token, wchar_t const *name) const
+    {
+        switch (token.type)
+        {
+            case LITERAL:
+            {
+                wchar_t const *text = _text.data() + token.begin;
+                for (uint32_t k = 0; k < token.length; k++)
+                {
+                    if (_fold(name[k]) != text[k])
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            case ANY:
+                return true;
+
+            case CLASS:
+                return _inClass(token, name[0]) != token.negated;
+
+            default:
+                return false;
+        }
+    }
+
+    bool _caseSensitive = false;
+    bool _foldedNames = false;
+    size_t _minLength = 0;
+
+    std::vector<Token> _tokens;
+    std::wstring _text; // literal characters, folded like the names unless case sensitive
+    std::vector<Range> _ranges;
+};
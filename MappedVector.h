@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+// Array that either owns its elements or refers to ones in a mapped snapshot.
+// A view is used in place; the first call that changes the size copies it into owned
+// storage. Element writes through a view go to the mapping, which is mapped copy on write.
+
+template <class _Type> class MappedVector
+{
+public:
+    MappedVector()
+    {
+    }
+
+    MappedVector(MappedVector const &other)
+    {
+        *this = other;
+    }
+
+    MappedVector(MappedVector &&other) noexcept
+        : _owned(std::move(other._owned)), _data(other._data), _size(other._size)
+    {
+        other._data = nullptr;
+        other._size = 0;
+    }
+
+    MappedVector &operator=(MappedVector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            _owned = std::move(other._owned);
+            _data = other._data;
+            _size = other._size;
+            other._data = nullptr;
+            other._size = 0;
+        }
+        return *this;
+    }
+
+    MappedVector &operator=(MappedVector const &other)
+    {
+        if (this != &other)
+        {
+            if (other._data == other._owned.data())
+            {
+                _owned = other._owned;
+                _data = _owned.data();
+            }
+            else
+            {
+                _owned.clear();
+                _data = other._data;
+            }
+            _size = other._size;
+        }
+        return *this;
+    }
+
+    // refer to size elements at data, which must outlive this
+    void view(_Type *data, size_t size)
+    {
+        _owned.clear();
+        _owned.shrink_to_fit();
+        _data = data;
+        _size = size;
+    }
+
+    bool isView() const
+    {
+        return _data != nullptr && _data != _owned.data();
+    }
+
+    _Type &operator[](size_t i)
+    {
+        return _data[i];
+    }
+
+    _Type const &operator[](size_t i) const
+    {
+        return _data[i];
+    }
+
+    _Type *data()
+    {
+        return _data;
+    }
+
+    _Type const *data() const
+    {
+        return _data;
+    }
+
+    _Type *begin()
+    {
+        return _data;
+    }
+
+    _Type *end()
+    {
+        return _data + _size;
+    }
+
+    _Type const *begin() const
+    {
+        return _data;
+    }
+
+    _Type const *end() const
+    {
+        return _data + _size;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    void resize(size_t size)
+    {
+        _own();
+        _owned.resize(size);
+        _sync();
+    }
+
+    void push_back(_Type const &value)
+    {
+        _own();
+        _owned.push_back(value);
+        _sync();
+    }
+
+    void insert(size_t position, _Type const &value)
+    {
+        _own();
+        _owned.insert(_owned.begin() + position, value);
+        _sync();
+    }
+
+    void erase(size_t position)
+    {
+        _own();
+        _owned.erase(_owned.begin() + position);
+        _sync();
+    }
+
+    void append(_Type const *first, _Type const *last)
+    {
+        _own();
+        _owned.insert(_owned.end(), first, last);
+        _sync();
+    }
+
+    void clear()
+    {
+        _owned.clear();
+        _sync();
+    }
+
+private:
+    void _own()
+    {
+        if (isView())
+        {
+            _owned.assign(_data, _data + _size);
+        }
+    }
+
+    void _sync()
+    {
+        _data = _owned.data();
+        _size = _owned.size();
+    }
+
+    std::vector<_Type> _owned;
+    _Type *_data = nullptr;
+    size_t _size = 0;
+};
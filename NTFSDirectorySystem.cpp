@@ -2,24 +2,36 @@
 
 #include <memory>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <thread>
 
 #include <winioctl.h>
 
+#include "BlockingQueue.h"
+#include "Glob.h"
+#include "Regex.h"
+#include "Snapshot.h"
+#include "Utf8.h"
+
 // https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-fscc/a5bae3a3-9025-4f07-b70d-e2247b01faa6
 
-#include <codecvt>
 #include <string>
 
 std::wstring toStdWString(const std::string &utf8Str)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> conv;
-    return conv.from_bytes(utf8Str);
+    return decodeUtf8(utf8Str.data(), utf8Str.length());
 }
 
 std::string fromStdWString(const std::wstring &utf16Str)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> conv;
-    return conv.to_bytes(utf16Str);
+    std::string utf8;
+    appendUtf8(utf8, utf16Str.data(), utf16Str.length());
+    return utf8;
 }
 
 NTFSDirectorySystem::NTFSDirectorySystem()
@@ -27,11 +39,71 @@ NTFSDirectorySystem::NTFSDirectorySystem()
     memset(disks, 0, sizeof(DiskHandle *) * 32);
 }
 
+void NTFSDirectorySystem::setReadsInFlight(uint32_t count)
+{
+    _readsInFlight = std::max(count, 1u);
+}
+
+void NTFSDirectorySystem::setParserThreads(uint32_t count)
+{
+    if (count == 0)
+    {
+        count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    _parserThreads = count;
+}
+
+void NTFSDirectorySystem::setCollectFileDetails(bool collect)
+{
+    _collectFileDetails = collect;
+}
+
+void NTFSDirectorySystem::setIncrementalRescan(bool incremental)
+{
+    _incrementalRescan = incremental;
+}
+
+void NTFSDirectorySystem::setConcurrentScan(bool concurrent)
+{
+    _concurrentScan = concurrent;
+}
+
+void NTFSDirectorySystem::setTrigramIndex(bool enabled)
+{
+    _trigramIndex = enabled;
+}
+
+size_t NTFSDirectorySystem::trigramIndexMemory(int driveMask) const
+{
+    size_t bytes = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            bytes += disks[i]->trigrams.memory() + disks[i]->trigramsPending.capacity() * sizeof(uint32_t);
+        }
+    }
+
+    return bytes;
+}
+
+RecordChanges const *NTFSDirectorySystem::changes(int drive) const
+{
+    if (drive < 0 || drive >= 32 || disks[drive] == nullptr)
+    {
+        return nullptr;
+    }
+    return &disks[drive]->changes;
+}
+
 // mask for drives
 //
 
-bool NTFSDirectorySystem::readDisks(uint32_t driveMask, bool reload)
+bool NTFSDirectorySystem::readDisks(uint32_t driveMask, bool reload, bool deleted)
 {
+    std::vector<DiskHandle *> load;
+    bool opened = true;
 
     if (reload)
     {
@@ -39,10 +111,14 @@ bool NTFSDirectorySystem::readDisks(uint32_t driveMask, bool reload)
         {
             if (disks[i])
             {
-                if (!_loadSearchInfo(disks[i]))
+                // the journal does not bring back records that were skipped as free
+                if (disks[i]->scanDeleted != deleted)
                 {
-                    return false;
+                    disks[i]->usnJournalId = 0;
+                    disks[i]->stamps.clear();
                 }
+                disks[i]->scanDeleted = deleted;
+                load.push_back(disks[i]);
             }
         }
     }
@@ -67,14 +143,13 @@ bool NTFSDirectorySystem::readDisks(uint32_t driveMask, bool reload)
                         disks[i] = _openDisk('A' + i);
                         if (disks[i] != nullptr)
                         {
-                            if (!_loadSearchInfo(disks[i]))
-                            {
-                                return false;
-                            }
+                            disks[i]->drive = i;
+                            disks[i]->scanDeleted = deleted;
+                            load.push_back(disks[i]);
                         }
                         else
                         {
-                            return false;
+                            opened = false;
                         }
                     }
                 }
@@ -82,710 +157,2638 @@ bool NTFSDirectorySystem::readDisks(uint32_t driveMask, bool reload)
         }
     }
 
-    return true;
+    return _loadDisks(load) && opened;
 }
 
-int NTFSDirectorySystem::searchForFilesViaExtensions(int driveMask, std::unordered_set<String> const &extensions,
-                                                     bool deleted)
-{
-
-    std::unordered_set<std::wstring> wextensions;
-
-    for (auto const &str : extensions)
-    {
-        wextensions.insert(toStdWString(str));
-    }
-
-    uint32_t ret = 0;
+// Scans the disks one after another, or with concurrent scanning all at once, each with
+// its own reader and parser threads. Progress is then only reported from this thread,
+// summed over all disks, since signalDirectoryProgress is not expected to be thread safe.
 
-    for (int i = 0; i < 32; i++)
+bool NTFSDirectorySystem::_loadDisks(std::vector<DiskHandle *> const &load)
+{
+    if (!_concurrentScan || load.size() < 2)
     {
-        if ((driveMask & (1 << i)) && disks[i])
+        bool loaded = true;
+        for (DiskHandle *disk : load)
         {
-            ret += _searchForFilesViaExtensions(disks[i], wextensions, deleted);
+            // a disk that fails does not keep the others from loading
+            loaded = _loadSearchInfo(disk) && loaded;
         }
+        return loaded;
     }
 
-    return ret;
-}
-#if 0
-
-int NTFSDirectorySystem::searchForFilesViaRegularExpression(int driveMask, wchar_t *filename, bool deleted)
-{
-    uint32_t ret = 0;
+    std::vector<ScanProgress> progress(load.size());
+    std::vector<char> loaded(load.size(), 0);
 
-    SearchPattern *pat;
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t running = load.size();
 
-    pat = _startSearch(filename, wcslen(filename));
-    if (!pat)
+    std::vector<std::thread> scans;
+    for (size_t i = 0; i < load.size(); i++)
     {
-        return 0;
+        load[i]->progress = &progress[i];
+
+        scans.emplace_back([&, i]() {
+            loaded[i] = _loadSearchInfo(load[i]);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+            finished.notify_one();
+        });
     }
 
-    for (int i = 0; i < 32; i++)
+    String text("Reading ");
+    text += std::to_string(load.size());
+    text += " Drives";
+
+    auto report = [&]() {
+        uint64_t done = 0;
+        uint64_t total = 0;
+        for (auto const &disk : progress)
+        {
+            done += disk.done;
+            total += disk.total;
+        }
+        signalDirectoryProgress(size_t(done), size_t(total), text);
+    };
+
     {
-        if ((driveMask & (1 << i)) && disks[i])
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running > 0)
         {
-            if (disks[i] != nullptr)
+            if (!finished.wait_for(lock, std::chrono::milliseconds(100), [&]() { return running == 0; }))
             {
-                ret += _searchForFilesViaRegularExpression(disks[i], filename, deleted, pat);
+                lock.unlock();
+                report();
+                lock.lock();
             }
         }
     }
 
-    _endSearch(pat);
+    for (auto &scan : scans)
+    {
+        scan.join();
+    }
 
-    _directoryList.clear();
+    report();
 
-    return ret;
+    bool ok = true;
+    for (size_t i = 0; i < load.size(); i++)
+    {
+        load[i]->progress = nullptr;
+        ok = ok && loaded[i];
+    }
+    return ok;
 }
 
-#endif
+// progress of a scan, kept for the summed report when several disks are scanned at once
+void NTFSDirectorySystem::_signalProgress(DiskHandle *disk, size_t n, size_t total, String const &text)
+{
+    if (disk->progress != nullptr)
+    {
+        disk->progress->done = n;
+        disk->progress->total = total;
+        return;
+    }
+    signalDirectoryProgress(n, total, text);
+}
 
-int NTFSDirectorySystem::gatherAllFiles(int driveMask, bool deleted)
+bool NTFSDirectorySystem::readImage(int drive, String const &imagePath, bool deleted)
 {
+    if (drive < 0 || drive >= 32)
+    {
+        return false;
+    }
 
-    uint32_t ret = 0;
+    if (disks[drive] != nullptr)
+    {
+        _closeDisk(disks[drive]);
+        disks[drive] = nullptr;
+    }
 
-    for (int i = 0; i < 32; i++)
+    VolumeSource *source = openVolumeSource(imagePath);
+    if (source == nullptr)
     {
-        if ((driveMask & (1 << i)) && disks[i])
-        {
-            ret += _gatherAllFiles(disks[i], deleted);
-        }
+        return false;
     }
 
-    return ret;
+    DiskHandle *disk = _openDisk(source);
+    if (disk == nullptr)
+    {
+        return false;
+    }
+
+    // no drive letter, paths are reported relative to the image root
+    disk->label = imagePath;
+    disk->scanDeleted = deleted;
+    disk->drive = drive;
+    disks[drive] = disk;
+
+    return _loadSearchInfo(disk);
 }
 
-int NTFSDirectorySystem::gatherAllDirectories(int driveMask, bool deleted)
+bool NTFSDirectorySystem::saveSnapshot(int drive, String const &file)
 {
+    if (drive < 0 || drive >= 32 || disks[drive] == nullptr)
+    {
+        return false;
+    }
 
-    uint32_t ret = 0;
+    DiskHandle *disk = disks[drive];
+    if (disk->type != eNTFS_DISK || disk->filesSize == 0)
+    {
+        return false;
+    }
 
-    for (int i = 0; i < 32; i++)
+    SnapshotWriter writer;
+    if (!writer.open(file))
     {
-        if ((driveMask & (1 << i)) && disks[i])
-        {
-            ret += _gatherAllDirectories(disks[i], deleted);
-        }
+        return false;
     }
 
-    return ret;
-}
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.serialNumber = disk->bootBlock.SerialNumber;
+    header.sizeMFT = disk->NTFS.sizeMFT;
+    header.bytesPerFileRecord = disk->NTFS.bytesPerFileRecord;
+    header.filesSize = disk->filesSize;
+    header.realFiles = disk->realFiles;
+    header.nameChunkSize = NAME_CHUNK_SIZE;
+    header.nameChunks = disk->names.chunkCount();
+    header.detailsCount = disk->details.empty() ? 0 : disk->filesSize;
+    header.usnJournalRecord = disk->usnJournalRecord;
+    header.usnJournalId = disk->usnJournalId;
+    header.usnCursor = disk->usnCursor;
+
+    // the header is written again once the offsets are known
+    bool ok = writer.write(&header, sizeof(header)) && writer.align();
+
+    header.filesOffset = writer.position();
+    ok = ok && writer.write(disk->files.data(), disk->filesSize * sizeof(FileEntry)) && writer.align();
+
+    header.namesOffset = writer.position();
+    for (uint32_t i = 0; ok && i < header.nameChunks; i++)
+    {
+        ok = writer.write(disk->names.chunk(i), NAME_CHUNK_SIZE * sizeof(wchar_t));
+    }
+    ok = ok && writer.align();
 
-bool NTFSDirectorySystem::_loadSearchInfo(DiskHandle *disk)
-{
-    uint64_t res;
-    if (disk->filesSize == 0)
+    // folded even while the system is case sensitive, so any loader can map them
+    if (disk->upcase.empty())
     {
-        if (res = _loadMFT(disk, FALSE) != 0)
+        _readUpCase(disk);
+    }
+
+    std::unique_ptr<wchar_t[]> folded;
+    header.foldedOffset = writer.position();
+    header.upcaseHash = disk->upcaseHash;
+    for (uint32_t i = 0; ok && i < header.nameChunks; i++)
+    {
+        if (i < disk->foldedNames.chunkCount())
         {
-            _parseMFT(disk);
-            return true;
+            ok = writer.write(disk->foldedNames.chunk(i), NAME_CHUNK_SIZE * sizeof(wchar_t));
+            continue;
         }
-        else
+
+        if (folded == nullptr)
         {
-            return false;
+            folded.reset(new wchar_t[NAME_CHUNK_SIZE]);
         }
+        FoldedNames::fold(disk->names.chunk(i), disk->upcase.data(), folded.get());
+        ok = writer.write(folded.get(), NAME_CHUNK_SIZE * sizeof(wchar_t));
     }
-    else
+    ok = ok && writer.align();
+
+    if (header.detailsCount != 0)
     {
-        return _reparseDisk(disk);
+        header.detailsOffset = writer.position();
+        ok = ok && writer.write(disk->details.data(), header.detailsCount * sizeof(LongFileInfo)) && writer.align();
     }
 
-    return true;
-}
-int NTFSDirectorySystem::_searchForFilesViaRegularExpression(DiskHandle *disk, wchar_t *filename, bool deleted,
-                                                             SearchPattern *pat)
-{
-    int hits = 0;
+    // posting lists, then the keys and ids they refer to
+    std::vector<SnapshotExtension> postings(disk->extensions.size());
+    uint64_t keysLength = 0;
+    uint64_t idsCount = 0;
 
-    wchar_t tmp[0xffff];
+    for (uint32_t slot = 0; slot < disk->extensions.size(); slot++)
+    {
+        postings[slot].keyOffset = uint32_t(keysLength);
+        postings[slot].keyLength = uint32_t(disk->extensions.key(slot).length());
+        postings[slot].idsOffset = idsCount;
+        postings[slot].idsCount = disk->extensionFiles[slot].size();
 
-    bool res = 0;
-    auto len = wcslen(filename);
+        keysLength += postings[slot].keyLength;
+        idsCount += postings[slot].idsCount;
+    }
 
-    if (!_caseSensitive)
+    header.extensionCount = uint32_t(postings.size());
+    header.extensionKeysLength = uint32_t(keysLength);
+    header.extensionIdsCount = idsCount;
+
+    header.extensionsOffset = writer.position();
+    ok = ok && writer.write(postings.data(), postings.size() * sizeof(SnapshotExtension)) && writer.align();
+
+    header.extensionKeysOffset = writer.position();
+    for (uint32_t slot = 0; ok && slot < disk->extensions.size(); slot++)
     {
-        _wcslwr_s(filename, len + 1);
+        std::wstring const &key = disk->extensions.key(slot);
+        ok = writer.write(key.data(), key.length() * sizeof(wchar_t));
     }
-    auto &info = disk->fileInfo;
+    ok = ok && writer.align();
 
-    String searchText("Searching Drive ");
-    searchText += disk->dosDevice;
-    searchText += ":\\";
-
-    for (auto i = 0ul; i < disk->filesSize; i++)
+    header.extensionIdsOffset = writer.position();
+    for (uint32_t slot = 0; ok && slot < disk->extensions.size(); slot++)
     {
-        if (deleted || (info[i].flags & 0x1))
-        {
-            if (info[i].fileName != nullptr)
-            {
-                std::wstring fileName(info[i].fileName);
+        auto const &ids = disk->extensionFiles[slot];
+        ok = writer.write(ids.data(), ids.size() * sizeof(uint32_t));
+    }
+    ok = ok && writer.align();
 
-                if (!_caseSensitive)
-                {
-                    memcpy(tmp, info[i].fileName, info[i].fileNameLength * sizeof(wchar_t) + 2);
-                    _wcslwr_s(tmp, wcslen(tmp) + 1);
-                    res = _searchString(pat, (wchar_t *)tmp, info[i].fileNameLength);
-                }
-                else
-                {
-                    res = _searchString(pat, (wchar_t *)info[i].fileName, info[i].fileNameLength);
-                }
+    header.fileSize = writer.position();
+    ok = ok && writer.writeAt(0, &header, sizeof(header));
 
-                if (res)
-                {
-                    std::wstring path = _path(disk, i);
+    return ok && writer.commit();
+}
 
-                    std::wstring fileName(info[i].fileName);
+bool NTFSDirectorySystem::loadSnapshot(int drive, String const &file, String const &imagePath)
+{
+    if (drive < 0 || drive >= 32)
+    {
+        return false;
+    }
 
-                    _saveFileName(path, fileName);
+    if (disks[drive] != nullptr)
+    {
+        _closeDisk(disks[drive]);
+        disks[drive] = nullptr;
+    }
 
-                    hits++;
-                }
-            }
-        }
-        if ((i % 1000) == 0)
+    DiskHandle *disk;
+    if (imagePath.empty())
+    {
+        disk = _openDisk(wchar_t('A' + drive));
+    }
+    else
+    {
+        VolumeSource *source = openVolumeSource(imagePath);
+        disk = source ? _openDisk(source) : nullptr;
+        if (disk != nullptr)
         {
-            signalDirectoryProgress(i, disk->filesSize, searchText);
+            disk->label = imagePath;
         }
     }
 
-    signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
-
-    return hits;
-}
+    if (disk == nullptr)
+    {
+        return false;
+    }
 
-/*
+    disk->drive = drive;
+    disks[drive] = disk;
 
-*/
+    // record 0 gives the current size of $MFT to check the snapshot against
+    if (_loadMFT(disk, false) == 0)
+    {
+        return false;
+    }
 
-std::wstring NTFSDirectorySystem::_extension(std::wstring const &fileName)
-{
-    auto pos = fileName.find_last_of(L".");
+    bool loaded = true;
 
-    if (pos != std::wstring::npos)
+    if (!_readSnapshot(disk, file))
     {
-        return fileName.substr(pos + 1);
+        _parseMFT(disk);
     }
-    else
+    else if (disk->usnJournalId != 0 && !_replayJournal(disk))
     {
-        return L"";
+        // the journal was reset or has wrapped since the snapshot was taken
+        loaded = _reparseDisk(disk);
     }
-}
 
-bool NTFSDirectorySystem::_startsWith(std::wstring const &name, std::wstring const &start)
-{
-    return (_wcsnicmp(name.data(), start.data(), start.length()) == 0);
-}
+    _updateNameIndexes(disk);
 
-void toLower(std::wstring &str)
-{
-    std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return loaded;
 }
 
-int NTFSDirectorySystem::_searchForFilesViaExtensions(DiskHandle *disk,
-                                                      std::unordered_set<std::wstring> const &extensions, bool deleted)
-{
-    int hits = 0;
-
-    bool res = 0;
+// Maps a snapshot and points the disk's tables into it, nothing is copied or converted.
+// Fails without touching the disk when the file is not a snapshot of this volume as it
+// is now, its sections do not fit in the file, or a name or id points outside them.
 
-    auto &info = disk->fileInfo;
+bool NTFSDirectorySystem::_readSnapshot(DiskHandle *disk, String const &file)
+{
+    std::unique_ptr<MappedFile> mapped(new MappedFile);
+    if (!mapped->open(file) || mapped->size() < sizeof(SnapshotHeader))
+    {
+        return false;
+    }
 
-    String searchText("Searching Drive ");
-    searchText += disk->dosDevice;
-    searchText += ":\\";
+    uint8_t *base = mapped->data();
+    SnapshotHeader const &header = *(SnapshotHeader const *)base;
 
-    for (auto i = 0ul; i < disk->filesSize; i++)
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.headerSize != sizeof(SnapshotHeader) || header.fileSize != mapped->size())
     {
-        if (deleted || (info[i].flags & IN_USE))
-        {
-            if ((info[i].flags & IS_DIRECTORY) || (info[i].fileName == nullptr))
-            {
-                continue;
-            }
+        return false;
+    }
 
-            std::wstring fileName(info[i].fileName);
+    // with a journal position the change is replayed after loading, without one a grown
+    // $MFT means the snapshot is out of date
+    if (header.serialNumber != uint64_t(disk->bootBlock.SerialNumber) ||
+        (header.sizeMFT != disk->NTFS.sizeMFT && header.usnJournalId == 0) ||
+        header.bytesPerFileRecord != disk->NTFS.bytesPerFileRecord || header.filesSize > disk->NTFS.entryCount ||
+        header.nameChunkSize != NAME_CHUNK_SIZE ||
+        (header.detailsCount != 0 && header.detailsCount != header.filesSize))
+    {
+        return false;
+    }
 
-            if (fileName == L"IMG_7889.jpg")
-            {
-                int t = 1;
-            }
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset % sizeof(uint64_t) == 0 && offset <= header.fileSize &&
+               count <= (header.fileSize - offset) / size;
+    };
+
+    if (!fits(header.filesOffset, header.filesSize, sizeof(FileEntry)) ||
+        !fits(header.namesOffset, uint64_t(header.nameChunks) * NAME_CHUNK_SIZE, sizeof(wchar_t)) ||
+        !fits(header.foldedOffset, uint64_t(header.nameChunks) * NAME_CHUNK_SIZE, sizeof(wchar_t)) ||
+        (header.detailsCount != 0 && !fits(header.detailsOffset, header.detailsCount, sizeof(LongFileInfo))) ||
+        !fits(header.extensionsOffset, header.extensionCount, sizeof(SnapshotExtension)) ||
+        !fits(header.extensionKeysOffset, header.extensionKeysLength, sizeof(wchar_t)) ||
+        !fits(header.extensionIdsOffset, header.extensionIdsCount, sizeof(uint32_t)))
+    {
+        return false;
+    }
 
-            std::wstring lowerCaseFileName(fileName);
-            toLower(lowerCaseFileName);
+    SnapshotExtension const *postings = (SnapshotExtension const *)(base + header.extensionsOffset);
+    wchar_t const *keys = (wchar_t const *)(base + header.extensionKeysOffset);
+    uint32_t *ids = (uint32_t *)(base + header.extensionIdsOffset);
 
-            std::wstring ext = _extension(lowerCaseFileName);
+    for (uint32_t i = 0; i < header.extensionCount; i++)
+    {
+        SnapshotExtension const &posting = postings[i];
+        if (uint64_t(posting.keyOffset) + posting.keyLength > header.extensionKeysLength ||
+            posting.idsOffset > header.extensionIdsCount || posting.idsCount > header.extensionIdsCount - posting.idsOffset)
+        {
+            return false;
+        }
+    }
 
-            bool extensionFound = (extensions.find(ext) != extensions.end());
+    // a damaged file must not send name() or files[id] outside the mapping
+    FileEntry const *files = (FileEntry const *)(base + header.filesOffset);
+    uint64_t nameSpace = uint64_t(header.nameChunks) << NAME_CHUNK_SHIFT;
+    for (uint32_t i = 0; i < header.filesSize; i++)
+    {
+        FileEntry const &entry = files[i];
+        if (entry.nameLength != 0 &&
+            ((entry.nameOffset & (NAME_CHUNK_SIZE - 1)) + uint64_t(entry.nameLength) >= NAME_CHUNK_SIZE ||
+             entry.nameOffset >= nameSpace))
+        {
+            return false;
+        }
+    }
 
-            if (extensionFound)
-            {
-                std::wstring path = _path(disk, i);
+    for (uint64_t i = 0; i < header.extensionIdsCount; i++)
+    {
+        if (ids[i] >= header.filesSize)
+        {
+            return false;
+        }
+    }
 
-                bool onBlackList = false;
-                for (auto &blackName : _blackList)
-                {
-                    if (_startsWith(path, blackName))
-                    {
-                        onBlackList = true;
-                        break;
-                    }
-                }
+    _dropDiskIndex(disk);
 
-                if (onBlackList)
-                {
-                    continue;
-                }
+    disk->names.mapChunks((wchar_t *)(base + header.namesOffset), header.nameChunks);
 
-                if (!(info[i].flags & IS_DIRECTORY))
-                {
+    // folded with another table the names are folded again after loading
+    if (!_caseSensitive)
+    {
+        if (disk->upcase.empty())
+        {
+            _readUpCase(disk);
+        }
+        if (header.upcaseHash == disk->upcaseHash)
+        {
+            disk->foldedNames.mapChunks((wchar_t *)(base + header.foldedOffset), header.nameChunks);
+        }
+    }
+    disk->files.view((FileEntry *)(base + header.filesOffset), header.filesSize);
 
-                    _saveFileName(path, fileName);
-                }
+    if (header.detailsCount != 0)
+    {
+        disk->details.view((LongFileInfo *)(base + header.detailsOffset), header.detailsCount);
+    }
 
-                hits++;
-            }
-        }
+    // the key table is small, only the id lists stay in the mapping
+    for (uint32_t i = 0; i < header.extensionCount; i++)
+    {
+        SnapshotExtension const &posting = postings[i];
 
-        if ((i % 1000) == 0)
+        uint32_t slot = disk->extensions.add(keys + posting.keyOffset, posting.keyLength);
+        if (slot == disk->extensionFiles.size())
         {
-            signalDirectoryProgress(i, disk->filesSize, searchText);
+            disk->extensionFiles.emplace_back();
         }
+        disk->extensionFiles[slot].view(ids + posting.idsOffset, size_t(posting.idsCount));
     }
 
-    signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
+    disk->filesSize = header.filesSize;
+    disk->realFiles = header.realFiles;
+    disk->usnJournalRecord = header.usnJournalRecord;
+    disk->usnJournalId = header.usnJournalId;
+    disk->usnCursor = header.usnCursor;
+    disk->snapshot = std::move(mapped);
+
+    return true;
+}
+
+// forgets the parsed state of a disk, and the snapshot it may point into
+void NTFSDirectorySystem::_dropDiskIndex(DiskHandle *disk)
+{
+    disk->names.clear();
+    disk->files.clear();
+    disk->details.clear();
+    disk->stamps.clear();
+    disk->changes.clear();
+    disk->pathCache.clear();
+    disk->extensions.clear();
+    disk->extensionFiles.clear();
+    disk->foldedNames.clear();
+    disk->trigrams.clear();
+    disk->trigramsPending.clear();
+    disk->excluded.clear();
+    disk->excludedVersion = 0;
+    disk->snapshot.reset();
+    disk->replayNames = NameArena::Cursor(&disk->names);
+
+    disk->usnJournalRecord = 0;
+    disk->usnJournalId = 0;
+    disk->usnCursor = 0;
+
+    disk->filesSize = 0;
+    disk->realFiles = 0;
+}
+
+int NTFSDirectorySystem::searchForFilesViaExtensions(int driveMask, std::unordered_set<String> const &extensions,
+                                                     bool deleted)
+{
+
+    std::unordered_set<std::wstring> wextensions;
+
+    for (auto const &str : extensions)
+    {
+        wextensions.insert(toStdWString(str));
+    }
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            ret += _searchForFilesViaExtensions(disks[i], wextensions, deleted);
+        }
+    }
+
+    return ret;
+}
+int NTFSDirectorySystem::searchForFilesViaGlob(int driveMask, String const &pattern, bool deleted)
+{
+    std::wstring widePattern = toStdWString(pattern);
+
+    if (widePattern.empty())
+    {
+        return 0;
+    }
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            // folded like the names of this volume
+            GlobPattern glob(widePattern.data(), widePattern.length(), _caseSensitive, _searchFold(disks[i]));
+            ret += _searchForFilesViaGlob(disks[i], glob, deleted);
+        }
+    }
+
+    return ret;
+}
+
+int NTFSDirectorySystem::searchForFilesViaRegularExpression(int driveMask, String const &expression, bool deleted)
+{
+    std::wstring wideExpression = toStdWString(expression);
+
+    // Whether a pattern compiles does not depend on the $UpCase it is folded with, so
+    // it is checked on the first drive, before any drive has sent results.
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            if (_compileRegularExpression(wideExpression, disks[i]) == nullptr)
+            {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            RegexPattern *regex = _compileRegularExpression(wideExpression, disks[i]);
+            if (regex != nullptr)
+            {
+                ret += _searchForFilesViaRegularExpression(disks[i], *regex, deleted);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int NTFSDirectorySystem::searchForFilesViaSubstring(int driveMask, String const &text, bool deleted)
+{
+    std::wstring wideText = toStdWString(text);
+    if (wideText.empty())
+    {
+        return 0;
+    }
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            ret += _searchForFilesViaSubstring(disks[i], wideText, deleted);
+        }
+    }
+
+    return ret;
+}
+
+// compiled regular expressions kept for repeated searches
+#define REGEX_CACHE_SIZE 8
+
+// The DFA states a pattern has built stay with it, so a repeated query starts with the
+// transitions the last one found. A case insensitive pattern is folded through the
+// volume's $UpCase, volumes with the same table share it.
+
+RegexPattern *NTFSDirectorySystem::_compileRegularExpression(std::wstring const &expression, DiskHandle *disk)
+{
+    wchar_t const *upcase = _searchFold(disk);
+    uint64_t fold = upcase != nullptr ? disk->upcaseHash : 0;
+
+    for (size_t i = 0; i < _regexCache.size(); i++)
+    {
+        auto cached = _regexCache[i];
+        if (cached.first == fold && cached.second->pattern() == expression &&
+            cached.second->caseSensitive() == _caseSensitive)
+        {
+            _regexCache.erase(_regexCache.begin() + i);
+            _regexCache.insert(_regexCache.begin(), cached);
+            return cached.second.get();
+        }
+    }
+
+    std::shared_ptr<RegexPattern> regex = std::make_shared<RegexPattern>();
+    if (!regex->compile(expression, _caseSensitive, upcase))
+    {
+        return nullptr;
+    }
+
+    if (_regexCache.size() >= REGEX_CACHE_SIZE)
+    {
+        _regexCache.pop_back();
+    }
+    _regexCache.insert(_regexCache.begin(), std::make_pair(fold, regex));
+    return regex.get();
+}
+
+int NTFSDirectorySystem::gatherAllFiles(int driveMask, bool deleted)
+{
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            ret += _gatherAllFiles(disks[i], deleted);
+        }
+    }
+
+    return ret;
+}
+
+int NTFSDirectorySystem::gatherAllDirectories(int driveMask, bool deleted)
+{
+
+    uint32_t ret = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            ret += _gatherAllDirectories(disks[i], deleted);
+        }
+    }
+
+    return ret;
+}
+
+bool NTFSDirectorySystem::_loadSearchInfo(DiskHandle *disk)
+{
+    uint64_t res;
+    if (disk->filesSize == 0)
+    {
+        if (res = _loadMFT(disk, FALSE) != 0)
+        {
+            _parseMFT(disk);
+            _updateNameIndexes(disk);
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else
+    {
+        // only the changes logged since the last scan if the journal still has them,
+        // else only the records written since then
+        bool loaded = _replayJournal(disk) || _rescanDisk(disk) || _reparseDisk(disk);
+        _updateNameIndexes(disk);
+        return loaded;
+    }
+
+    return true;
+}
+int NTFSDirectorySystem::_searchForFilesViaGlob(DiskHandle *disk, GlobPattern const &glob, bool deleted)
+{
+    _resolveBlackList(disk);
+
+    int hits = 0;
+
+    auto &info = disk->files;
+
+    String searchText("Searching Drive ");
+    searchText += disk->label;
+
+    for (auto i = 0ul; i < disk->filesSize; i++)
+    {
+        if ((deleted || (info[i].flags & IN_USE)) && info[i].nameLength != 0)
+        {
+            if (glob.match(_searchName(disk, info[i]), info[i].nameLength) && !_excluded(disk, i))
+            {
+                _addResult(disk, i);
+
+                hits++;
+            }
+        }
+        if ((i % 1000) == 0)
+        {
+            signalDirectoryProgress(i, disk->filesSize, searchText);
+        }
+    }
+
+    _flushResults();
+
+    signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
 
     return hits;
 }
 
-int NTFSDirectorySystem::_gatherAllFiles(DiskHandle *disk, bool deleted)
+int NTFSDirectorySystem::_searchForFilesViaRegularExpression(DiskHandle *disk, RegexPattern &regex, bool deleted)
 {
+    _resolveBlackList(disk);
+
     int hits = 0;
-    bool res = 0;
-    auto &info = disk->fileInfo;
+
+    auto &info = disk->files;
 
     String searchText("Searching Drive ");
-    searchText += disk->dosDevice;
-    searchText += ":\\";
+    searchText += disk->label;
 
-    if (!_blackList.empty())
+    for (auto i = 0ul; i < disk->filesSize; i++)
+    {
+        if ((deleted || (info[i].flags & IN_USE)) && info[i].nameLength != 0)
+        {
+            if (regex.match(_searchName(disk, info[i]), info[i].nameLength) && !_excluded(disk, i))
+            {
+                _addResult(disk, i);
+
+                hits++;
+            }
+        }
+        if ((i % 1000) == 0)
+        {
+            signalDirectoryProgress(i, disk->filesSize, searchText);
+        }
+    }
+
+    _flushResults();
+
+    signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
+
+    return hits;
+}
+
+// Records the trigram index offers, plus the ones changed since it was built, are checked
+// against the text; without the index, or for a text too short for it, all of them are.
+
+int NTFSDirectorySystem::_searchForFilesViaSubstring(DiskHandle *disk, std::wstring const &text, bool deleted)
+{
+    _resolveBlackList(disk);
+
+    int hits = 0;
+
+    String searchText("Searching Drive ");
+    searchText += disk->label;
+
+    std::wstring folded = text;
+    if (wchar_t const *upcase = _searchFold(disk))
+    {
+        for (auto &c : folded)
+        {
+            c = upcase[uint16_t(c)];
+        }
+    }
+
+    std::vector<uint32_t> ids;
+
+    if (disk->trigrams.built() && disk->trigrams.candidates(folded.data(), folded.length(), ids))
+    {
+        if (!disk->trigramsPending.empty())
+        {
+            std::vector<uint32_t> merged;
+            merged.reserve(ids.size() + disk->trigramsPending.size());
+            std::set_union(ids.begin(), ids.end(), disk->trigramsPending.begin(), disk->trigramsPending.end(),
+                           std::back_inserter(merged));
+            ids.swap(merged);
+        }
+
+        for (uint32_t id : ids)
+        {
+            if (id < disk->filesSize && _matchSubstring(disk, id, folded, deleted))
+            {
+                hits++;
+            }
+        }
+    }
+    else
     {
         for (auto i = 0ul; i < disk->filesSize; i++)
         {
-            if (deleted || (info[i].flags & IN_USE))
+            if (_matchSubstring(disk, i, folded, deleted))
             {
-                if (info[i].fileName != nullptr)
-                {
-                    std::wstring fileName(info[i].fileName);
+                hits++;
+            }
+            if ((i % 1000) == 0)
+            {
+                signalDirectoryProgress(i, disk->filesSize, searchText);
+            }
+        }
+    }
 
-                    std::wstring path = _path(disk, i);
+    _flushResults();
 
-                    bool onBlackList = false;
-                    for (auto &blackName : _blackList)
-                    {
-                        if (_startsWith(path, blackName))
-                        {
-                            onBlackList = true;
-                            break;
-                        }
-                    }
+    signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
 
-                    if (onBlackList)
-                    {
-                        continue;
-                    }
+    return hits;
+}
 
-                    if (!(info[i].flags & IS_DIRECTORY))
-                    {
-                        _saveFileName(path, fileName);
-                    }
+bool NTFSDirectorySystem::_matchSubstring(DiskHandle *disk, uint32_t id, std::wstring const &text, bool deleted)
+{
+    FileEntry const &entry = disk->files[id];
+
+    if ((!deleted && !(entry.flags & IN_USE)) || entry.nameLength == 0 ||
+        !containsText(_searchName(disk, entry), entry.nameLength, text.data(), text.length()) ||
+        _excluded(disk, id))
+    {
+        return false;
+    }
+
+    _addResult(disk, id);
+    return true;
+}
+
+// Builds the trigram index after a full scan or snapshot load. A reload that only applied
+// changes adds the records it touched to the pending list instead, until that grows past
+// a sixteenth of the index and a rebuild is cheaper than checking it on every search.
+
+void NTFSDirectorySystem::_updateTrigrams(DiskHandle *disk)
+{
+    if (!_trigramIndex)
+    {
+        disk->trigrams.clear();
+        disk->trigramsPending.clear();
+        return;
+    }
+
+    if (disk->trigrams.built())
+    {
+        auto &pending = disk->trigramsPending;
+        pending.insert(pending.end(), disk->changes.added.begin(), disk->changes.added.end());
+        pending.insert(pending.end(), disk->changes.modified.begin(), disk->changes.modified.end());
+        std::sort(pending.begin(), pending.end());
+        pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+
+        if (pending.size() <= std::max<size_t>(4096, disk->trigrams.records() / 16))
+        {
+            return;
+        }
+    }
+
+    disk->trigramsPending.clear();
+    disk->trigrams.build(disk->filesSize, [this, disk](uint32_t id, uint32_t *length) -> wchar_t const * {
+        FileEntry const &entry = disk->files[id];
+        *length = entry.nameLength;
+        return entry.nameLength != 0 ? _searchName(disk, entry) : nullptr;
+    });
+}
+
+void NTFSDirectorySystem::_updateNameIndexes(DiskHandle *disk)
+{
+    _updateFoldedNames(disk);
+    _updateTrigrams(disk);
+}
+
+// Folds the names once per load: the chunks added since the last one whole, and the names
+// a reload wrote into chunks folded before one by one. The chunks of a loaded snapshot
+// come folded already.
+
+void NTFSDirectorySystem::_updateFoldedNames(DiskHandle *disk)
+{
+    if (_caseSensitive)
+    {
+        disk->foldedNames.clear();
+        return;
+    }
+
+    if (disk->upcase.empty())
+    {
+        _readUpCase(disk);
+    }
+
+    bool folded = !disk->foldedNames.empty();
+    disk->foldedNames.update(disk->names, disk->upcase.data());
+
+    if (folded)
+    {
+        for (auto *ids : {&disk->changes.added, &disk->changes.modified})
+        {
+            for (uint32_t id : *ids)
+            {
+                if (id < disk->filesSize && disk->files[id].nameLength != 0)
+                {
+                    FileEntry const &entry = disk->files[id];
+                    disk->foldedNames.refold(disk->names, disk->upcase.data(), entry.nameOffset, entry.nameLength);
+                }
+            }
+        }
+    }
+}
+
+// $UpCase (record 10) maps every UTF-16 code unit to upper case the way the volume
+// compares names. Where it cannot be read towupper stands in.
+
+void NTFSDirectorySystem::_readUpCase(DiskHandle *disk)
+{
+    std::vector<uint8_t> record;
+    std::vector<uint8_t> data;
+
+    disk->upcase.clear();
+
+    if (_readRecord(disk, 10, record))
+    {
+        FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)record.data();
+        Attribute *attribute = _findNamedAttribute(file, uint32_t(record.size()), $DATA, L"");
+
+        if (attribute != nullptr && _readAttribute(disk, attribute, data) && data.size() >= 0x10000 * sizeof(uint16_t))
+        {
+            uint16_t const *table = (uint16_t const *)data.data();
+            disk->upcase.assign(table, table + 0x10000);
+        }
+    }
+
+    if (disk->upcase.empty())
+    {
+        disk->upcase.resize(0x10000);
+        for (uint32_t c = 0; c < 0x10000; c++)
+        {
+            disk->upcase[c] = wchar_t(uint16_t(towupper(wchar_t(c))));
+        }
+    }
+
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (wchar_t c : disk->upcase)
+    {
+        h = (h ^ uint16_t(c)) * 1099511628211ull;
+    }
+    disk->upcaseHash = h;
+}
+
+/*
+
+*/
+
+// Only the records on the posting lists of the wanted extensions are visited, merged
+// back into record order so the path cache sees the folders one after another.
+
+int NTFSDirectorySystem::_searchForFilesViaExtensions(DiskHandle *disk,
+                                                      std::unordered_set<std::wstring> const &extensions, bool deleted)
+{
+    _resolveBlackList(disk);
+
+    int hits = 0;
+
+    auto &info = disk->files;
+
+    String searchText("Searching Drive ");
+    searchText += disk->label;
+
+    std::vector<uint32_t> ids;
+
+    for (auto const &extension : extensions)
+    {
+        uint32_t slot = disk->extensions.find(extension.data(), uint32_t(extension.length()));
+
+        if (slot != ExtensionTable::NOT_FOUND)
+        {
+            auto const &files = disk->extensionFiles[slot];
+            ids.insert(ids.end(), files.begin(), files.end());
+        }
+    }
+
+    if (extensions.size() > 1)
+    {
+        // "JPG" and "jpg" share a list
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    for (size_t n = 0; n < ids.size(); n++)
+    {
+        uint32_t i = ids[n];
+
+        if (deleted || (info[i].flags & IN_USE))
+        {
+            if (_excluded(disk, i))
+            {
+                continue;
+            }
+
+            _addResult(disk, i);
+
+            hits++;
+        }
+
+        if ((n % 1000) == 0)
+        {
+            signalDirectoryProgress(n, ids.size(), searchText);
+        }
+    }
+
+    _flushResults();
+
+    signalDirectoryProgress(ids.size(), ids.size(), searchText);
+
+    return hits;
+}
+
+std::map<String, uint32_t> NTFSDirectorySystem::extensionCounts(int driveMask, bool deleted)
+{
+    std::map<String, uint32_t> counts;
+
+    for (int i = 0; i < 32; i++)
+    {
+        if ((driveMask & (1 << i)) && disks[i])
+        {
+            DiskHandle *disk = disks[i];
+
+            for (uint32_t slot = 0; slot < disk->extensions.size(); slot++)
+            {
+                uint32_t count = 0;
+
+                for (uint32_t id : disk->extensionFiles[slot])
+                {
+                    if (deleted || (disk->files[id].flags & IN_USE))
+                    {
+                        count++;
+                    }
+                }
+
+                if (count != 0)
+                {
+                    counts[fromStdWString(disk->extensions.key(slot))] += count;
+                }
+            }
+        }
+    }
+
+    return counts;
+}
+
+void NTFSDirectorySystem::_indexExtension(ParseContext *context, wchar_t const *name, uint32_t length, uint32_t id)
+{
+    uint32_t slot = context->extensions.addFileName(name, length);
+
+    if (slot == context->extensionFiles.size())
+    {
+        context->extensionFiles.emplace_back();
+    }
+    context->extensionFiles[slot].push_back(id);
+}
+
+int NTFSDirectorySystem::_gatherAllFiles(DiskHandle *disk, bool deleted)
+{
+    _resolveBlackList(disk);
+
+    int hits = 0;
+    bool res = 0;
+    auto &info = disk->files;
+
+    String searchText("Searching Drive ");
+    searchText += disk->label;
+
+    if (!_blackList.empty())
+    {
+        for (auto i = 0ul; i < disk->filesSize; i++)
+        {
+            if (deleted || (info[i].flags & IN_USE))
+            {
+                if (info[i].nameLength != 0)
+                {
+                    if (_excluded(disk, i))
+                    {
+                        continue;
+                    }
+
+                    if (!(info[i].flags & IS_DIRECTORY))
+                    {
+                        _addResult(disk, i);
+                    }
+
+                    hits++;
+                }
+            }
+            if ((i % 1000) == 0)
+            {
+                signalDirectoryProgress(0, disk->filesSize, searchText);
+            }
+        }
+        signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
+    }
+    else
+    {
+        for (auto i = 0ul; i < disk->filesSize; i++)
+        {
+            if (deleted || (info[i].flags & IN_USE))
+            {
+                if (info[i].nameLength != 0)
+                {
+
+                    if (!(info[i].flags & IS_DIRECTORY))
+                    {
+                        _addResult(disk, i);
+                    }
+
+                    hits++;
+                }
+            }
+        }
+    }
+
+    _flushResults();
+
+    return hits;
+}
+
+int NTFSDirectorySystem::_gatherAllDirectories(DiskHandle *disk, bool deleted)
+{
+    _resolveBlackList(disk);
+
+    int hits = 0;
+    bool res = 0;
+    auto &info = disk->files;
+
+    String searchText("Searching Drive ");
+    searchText += disk->label;
+
+    if (!_blackList.empty())
+    {
+        for (auto i = 0ul; i < disk->filesSize; i++)
+        {
+            if (deleted || (info[i].flags & IN_USE))
+            {
+                if (info[i].nameLength != 0)
+                {
+                    if (_excluded(disk, i))
+                    {
+                        continue;
+                    }
+
+                    if (info[i].flags & IS_DIRECTORY)
+                    {
+                        wchar_t const *name = disk->name(info[i]);
+
+                        if (wcscmp(name, L".") != 0 && wcscmp(name, L"..") != 0)
+                        {
+                            _addResult(disk, i);
+                        }
+                    }
+
+                    hits++;
+                }
+            }
+
+            if ((i % 1000) == 0)
+            {
+                signalDirectoryProgress(0, disk->filesSize, searchText);
+            }
+        }
+        signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
+    }
+    else
+    {
+        for (auto i = 0ul; i < disk->filesSize; i++)
+        {
+            if (deleted || (info[i].flags & IN_USE))
+            {
+                if (info[i].nameLength != 0)
+                {
+
+                    if (info[i].flags & IS_DIRECTORY)
+                    {
+                        _addResult(disk, i);
+                    }
+
+                    hits++;
+                }
+            }
+        }
+    }
+
+    _flushResults();
+
+    return hits;
+}
+// Hands the names and sizes found in extension records to their base records.
+// A record whose attributes do not fit lists them in $ATTRIBUTE_LIST and moves some to
+// extension records, each of which points back at the base. Every record in use is
+// parsed anyway, so the list itself is not read: the extension records are collected
+// while parsing and applied here, once all threads are done.
+//
+// The fixups of all threads are gathered into the disk's own buffer, kept between scans,
+// and sorted by base record, so they are applied in one pass in record order and the
+// lowest numbered extension record with a name wins whichever thread parsed it.
+
+void NTFSDirectorySystem::_applyFixups(DiskHandle *disk, std::vector<ParseContext> &contexts)
+{
+    auto &fixups = disk->fixups;
+    fixups.clear();
+
+    size_t total = 0;
+    for (auto const &context : contexts)
+    {
+        total += context.fixups.size();
+    }
+    fixups.reserve(total);
+
+    for (auto &context : contexts)
+    {
+        fixups.insert(fixups.end(), context.fixups.begin(), context.fixups.end());
+        context.fixups.clear();
+        context.fixups.shrink_to_fit();
+    }
+
+    std::sort(fixups.begin(), fixups.end(), [](Fixup const &a, Fixup const &b) {
+        return a.base != b.base ? a.base < b.base : a.extension < b.extension;
+    });
+
+    // new names go to the first thread's lists, merged into the disk's after this
+    ParseContext *context = &contexts[0];
+
+    // a rescan reports the unchanged bases that take a name from a changed extension
+    // record as replaced too, so their name and extension are updated like the others
+    std::vector<uint32_t> replaced;
+    if (context->rescan)
+    {
+        for (auto const &other : contexts)
+        {
+            for (auto const &record : other.replaced)
+            {
+                replaced.push_back(record.id);
+            }
+        }
+        std::sort(replaced.begin(), replaced.end());
+    }
+
+    for (auto const &fixup : fixups)
+    {
+        if (fixup.base >= disk->files.size())
+        {
+            continue;
+        }
+
+        FileEntry &entry = disk->files[fixup.base];
+
+        // a freed extension record can still point at a base that holds another file now
+        if ((entry.flags & IN_USE) && !(fixup.flags & FIXUP_IN_USE))
+        {
+            continue;
+        }
+
+        // the base keeps its own name, an extension record only fills in a missing one
+        if (entry.nameLength == 0 && fixup.nameLength != 0)
+        {
+            if (context->rescan && !std::binary_search(replaced.begin(), replaced.end(), fixup.base))
+            {
+                ReplacedRecord record;
+                record.id = fixup.base;
+                record.previous = entry;
+                context->replaced.push_back(record);
+            }
+
+            entry.nameOffset = fixup.nameOffset;
+            entry.nameLength = fixup.nameLength;
+            entry.parent = fixup.parent;
+
+            if (!(entry.flags & IS_DIRECTORY) && !context->rescan)
+            {
+                _indexExtension(context, disk->name(entry), entry.nameLength, fixup.base);
+            }
+        }
+
+        if ((fixup.flags & FIXUP_SIZE) && !disk->details.empty())
+        {
+            disk->details[fixup.base].fileSize = fixup.fileSize;
+            disk->details[fixup.base].allocatedFileSize = fixup.allocatedFileSize;
+        }
+    }
+
+    fixups.clear();
+}
+
+void NTFSDirectorySystem::clearBlackList()
+{
+    _blackList.clear();
+    _blackListVersion++;
+}
+
+void NTFSDirectorySystem::addToBlackList(String const &directory)
+{
+    _blackList.push_back(toStdWString(directory));
+    _blackListVersion++;
+}
+
+// Marks the directories at or below a blacklisted one in disk->excluded.
+// The blacklisted paths are split into a tree of folder names and every directory record
+// is matched against it once, through the state of its parent, so a search only tests
+// the bit of a file's folder instead of comparing its path with each entry.
+
+void NTFSDirectorySystem::_resolveBlackList(DiskHandle *disk)
+{
+    if (disk->excludedVersion == _blackListVersion)
+    {
+        return;
+    }
+    disk->excludedVersion = _blackListVersion;
+    disk->excluded.clear();
+
+    if (_blackList.empty() || disk->files.size() <= 5)
+    {
+        return;
+    }
+
+    struct Node
+    {
+        wchar_t const *name;
+        size_t length;
+        std::vector<uint32_t> children;
+        bool terminal;
+    };
+
+    std::vector<Node> tree(1, Node{nullptr, 0, {}, false});
+
+    // drive root as _path reports it, blacklisted paths must start with it
+    std::wstring const &root = _directoryPath(disk, 5);
+    size_t rootLength = root.length() - 1;
+
+    for (auto const &blackName : _blackList)
+    {
+        if (blackName.length() < rootLength || _wcsnicmp(blackName.data(), root.data(), rootLength) != 0)
+        {
+            continue;
+        }
+
+        uint32_t node = 0;
+        size_t pos = rootLength;
+
+        while (pos < blackName.length())
+        {
+            size_t end = blackName.find(L'\\', pos);
+            if (end == std::wstring::npos)
+            {
+                end = blackName.length();
+            }
+
+            size_t length = end - pos;
+            if (length != 0)
+            {
+                uint32_t child = 0;
+                for (uint32_t c : tree[node].children)
+                {
+                    if (tree[c].length == length && _wcsnicmp(tree[c].name, blackName.data() + pos, length) == 0)
+                    {
+                        child = c;
+                        break;
+                    }
+                }
+
+                if (child == 0)
+                {
+                    child = uint32_t(tree.size());
+                    tree.push_back(Node{blackName.data() + pos, length, {}, false});
+                    tree[node].children.push_back(child);
+                }
+                node = child;
+            }
+            pos = end + 1;
+        }
+
+        tree[node].terminal = true;
+    }
+
+    const int32_t UNRESOLVED = -2;
+    const int32_t OUTSIDE = -1;
+    const int32_t EXCLUDED = INT32_MAX;
+
+    auto &files = disk->files;
+
+    std::vector<int32_t> state(files.size(), UNRESOLVED);
+    state[0] = OUTSIDE;
+    state[5] = tree[0].terminal ? EXCLUDED : 0;
+
+    disk->excluded.assign((files.size() + 63) / 64, 0);
+
+    for (uint32_t d = 0; d < disk->filesSize; d++)
+    {
+        if (!(files[d].flags & IS_DIRECTORY) || state[d] != UNRESOLVED)
+        {
+            continue;
+        }
+
+        // walk up to the first resolved ancestor, then resolve on the way back down
+        uint32_t PathStack[64];
+        int PathStackPos = 0;
+
+        int32_t parentState = OUTSIDE;
+        uint32_t a = d;
+
+        while (true)
+        {
+            if (a >= files.size() || PathStackPos == 64)
+            {
+                parentState = OUTSIDE;
+                break;
+            }
+            if (state[a] != UNRESOLVED)
+            {
+                parentState = state[a];
+                break;
+            }
+            PathStack[PathStackPos++] = a;
+            a = files[a].parent;
+        }
+
+        for (int i = PathStackPos - 1; i >= 0; i--)
+        {
+            uint32_t pt = PathStack[i];
+            int32_t s = OUTSIDE;
+
+            if (parentState == EXCLUDED)
+            {
+                s = EXCLUDED;
+            }
+            else if (parentState != OUTSIDE && files[pt].nameLength != 0)
+            {
+                for (uint32_t c : tree[parentState].children)
+                {
+                    if (tree[c].length == files[pt].nameLength &&
+                        _wcsnicmp(tree[c].name, disk->name(files[pt]), tree[c].length) == 0)
+                    {
+                        s = tree[c].terminal ? EXCLUDED : int32_t(c);
+                        break;
+                    }
+                }
+            }
+
+            state[pt] = s;
+            if (s == EXCLUDED)
+            {
+                disk->excluded[pt >> 6] |= 1ull << (pt & 63);
+            }
+            parentState = s;
+        }
+    }
+
+    if (state[5] == EXCLUDED)
+    {
+        disk->excluded[0] |= 1ull << 5;
+    }
+}
+
+#include <strsafe.h>
+
+void ErrorMessage(LPTSTR lpszFunction)
+{
+    // Retrieve the system error message for the last-error code
+
+    LPVOID lpMsgBuf;
+    LPVOID lpDisplayBuf;
+    DWORD dw = GetLastError();
+
+    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, dw,
+                  MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPTSTR)&lpMsgBuf, 0, NULL);
+
+    // Display the error message and exit the process
+
+    lpDisplayBuf = (LPVOID)LocalAlloc(
+        LMEM_ZEROINIT, (lstrlen((LPCTSTR)lpMsgBuf) + lstrlen((LPCTSTR)lpszFunction) + 40) * sizeof(TCHAR));
+    StringCchPrintf((LPTSTR)lpDisplayBuf, LocalSize(lpDisplayBuf) / sizeof(TCHAR), TEXT("%s failed with error %d: %s"),
+                    lpszFunction, dw, lpMsgBuf);
+    MessageBox(NULL, (LPCTSTR)lpDisplayBuf, TEXT("Error"), MB_OK);
+
+    LocalFree(lpMsgBuf);
+    LocalFree(lpDisplayBuf);
+    // ExitProcess(dw);
+}
+
+// NONRESIDENT_ATTRIBUTE ERROR_ATTRIBUTE = {1,2,3,4,5};
+#define CLUSTERS_PER_READ 1024
+// smallest slice of a read buffer handed to a parser thread
+#define MIN_RECORDS_PER_RANGE 256
+// free MFT stretches shorter than this are read through rather than skipped
+#define MIN_SKIP_BYTES (64 * 1024)
+DiskHandle *NTFSDirectorySystem::_openDisk(wchar_t dosDevice)
+{
+    String path("\\\\.\\");
+    path.push_back(char(dosDevice));
+    path.push_back(':');
+
+    VolumeSource *source = openVolumeSource(path);
+    if (source == nullptr)
+    {
+        return nullptr;
+    }
+
+    DiskHandle *disk;
+    disk = _openDisk(source);
+    if (disk != nullptr)
+    {
+        disk->dosDevice = dosDevice;
+        disk->label = path.substr(4) + "\\";
+        return disk;
+    }
+    return nullptr;
+}
+
+#define BUFFER_SIZE (1024 * 1024)
+
+/*
+FILE_ID_DESCRIPTOR getFileIdDescriptor(const DWORDLONG fileId)
+{
+    FILE_ID_DESCRIPTOR fileDescriptor;
+    fileDescriptor.Type = FileIdType;
+    fileDescriptor.FileId.QuadPart = fileId;
+    fileDescriptor.dwSize = sizeof(fileDescriptor);
+    return fileDescriptor;
+}
+*/
+
+// takes ownership of source
+// the volume geometry comes from the boot sector so that image files, which cannot answer
+// FSCTL_GET_NTFS_VOLUME_DATA, are handled the same way as live volumes
+DiskHandle *NTFSDirectorySystem::_openDisk(VolumeSource *source)
+{
+    uint32_t read = 0;
+
+    DiskHandle *tmpDisk = new DiskHandle;
+    tmpDisk->source = source;
+
+    PACKED_BOOT_SECTOR &bootBlock = tmpDisk->bootBlock;
+
+    bool ok = source->read(0, &bootBlock, sizeof(PACKED_BOOT_SECTOR), &read);
+
+    if (ok && (read == sizeof(PACKED_BOOT_SECTOR)) && (strncmp("NTFS", (const char *)&bootBlock.Oem, 4) == 0) &&
+        (bootBlock.PackedBpb.BytesPerSector != 0) && (bootBlock.PackedBpb.SectorsPerCluster != 0))
+    {
+        tmpDisk->type = eNTFS_DISK;
+
+        uint32_t bytesPerSector = bootBlock.PackedBpb.BytesPerSector;
+        uint32_t bytesPerCluster = bytesPerSector * bootBlock.PackedBpb.SectorsPerCluster;
+
+        // a negative value is log2 of the record size in bytes
+        int8_t clustersPerRecord = int8_t(bootBlock.ClustersPerFileRecordSegment);
+        uint32_t bytesPerFileRecord =
+            clustersPerRecord > 0 ? clustersPerRecord * bytesPerCluster : 1u << uint32_t(-clustersPerRecord);
+
+        auto &volumeData = tmpDisk->NTFS.volumeData;
+        memset(&volumeData, 0, sizeof(NTFS_VOLUME_DATA));
+
+        volumeData.VolumeSerialNumber.QuadPart = bootBlock.SerialNumber;
+        volumeData.NumberSectors.QuadPart = bootBlock.NumberSectors;
+        volumeData.TotalClusters.QuadPart = bootBlock.NumberSectors / bootBlock.PackedBpb.SectorsPerCluster;
+        volumeData.BytesPerSector = bytesPerSector;
+        volumeData.BytesPerCluster = bytesPerCluster;
+        volumeData.BytesPerFileRecordSegment = bytesPerFileRecord;
+        volumeData.ClustersPerFileRecordSegment = bytesPerFileRecord / bytesPerCluster;
+        volumeData.MftStartLcn.QuadPart = bootBlock.MftStartLcn;
+        volumeData.Mft2StartLcn.QuadPart = bootBlock.Mft2StartLcn;
+
+        tmpDisk->NTFS.bytesPerCluster = bytesPerCluster;
+        tmpDisk->NTFS.bytesPerFileRecord = bytesPerFileRecord;
+
+        tmpDisk->NTFS.complete = false;
+        tmpDisk->NTFS.mftLocation = bootBlock.MftStartLcn * bytesPerCluster;
+
+        tmpDisk->NTFS.mft = nullptr;
+
+        tmpDisk->NTFS.sizeMFT = 0;
+
+        tmpDisk->NTFS.recordSize = bytesPerFileRecord;
+    }
+    else
+    {
+        tmpDisk->type = eUNKNOWN_DISK;
+    }
+
+    return tmpDisk;
+}
+
+void NTFSDirectorySystem::closeDisks()
+{
+
+    for (int i = 0; i < 32; i++)
+    {
+        _closeDisk(disks[i]);
+        disks[i] = nullptr;
+    }
+}
+
+bool NTFSDirectorySystem::_closeDisk(DiskHandle *disk)
+{
+    if (disk)
+    {
+        if (disk->source)
+        {
+            delete disk->source;
+        }
+        disk->source = nullptr;
+
+        if (disk->type == eNTFS_DISK)
+        {
+            if (disk->NTFS.mft)
+            {
+                delete[] disk->NTFS.mft;
+            }
+            disk->NTFS.mft = nullptr;
+            // delete disk->NTFS.bitmap;
+            // disk->NTFS.bitmap = nullptr;
+        }
+
+        delete disk;
+        return true;
+    }
+    return false;
+}
+
+uint64_t NTFSDirectorySystem::_loadMFT(DiskHandle *disk, bool complete)
+{
+    if (disk == nullptr)
+    {
+        return 0;
+    }
+
+    if (disk->type == eNTFS_DISK)
+    {
+        uint32_t read = 0;
+
+        // record 0 is $MFT itself, it can be larger than a cluster
+        uint32_t size = std::max(disk->NTFS.bytesPerCluster, disk->NTFS.bytesPerFileRecord);
+
+        uint8_t *buf = new uint8_t[size];
+        if (!disk->source->read(disk->NTFS.mftLocation, buf, size, &read) || read != size)
+        {
+            delete[] buf;
+            return 0;
+        }
+
+        FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)(buf);
+
+        _fixFileRecord(file);
+
+        NonresidentAttribute *dataAttribute = _findAttribute(file, AttributeType_e::Data);
+        NonresidentAttribute *bitmapAttribute = _findAttribute(file, AttributeType_e::Bitmap);
+
+        // one bit per record, used to skip the free parts of the MFT
+        disk->mftBitmap.clear();
+        if (bitmapAttribute && !_readAttribute(disk, bitmapAttribute, disk->mftBitmap))
+        {
+            disk->mftBitmap.clear();
+        }
+
+        if (dataAttribute == nullptr)
+        {
+            delete[] buf;
+            return 0;
+        }
+
+        disk->NTFS.sizeMFT = dataAttribute->dataSize;
+
+        // reloaded before a journal replay
+        delete[] disk->NTFS.mft;
+        disk->NTFS.mft = buf;
+
+        disk->NTFS.entryCount = uint32_t(disk->NTFS.sizeMFT / disk->NTFS.bytesPerFileRecord);
+        return dataAttribute->dataSize;
+    }
+
+    return 0;
+}
+
+NonresidentAttribute *NTFSDirectorySystem::_findAttribute(FILE_RECORD_SEGMENT_HEADER *file, int type)
+{
+    uint8_t *ptr = (uint8_t *)(file) + file->FirstAttributeOffset;
+
+    for (int i = 1; i < file->BytesAvailable; i++)
+    {
+        NonresidentAttribute *attr = (NonresidentAttribute *)ptr;
+        if (attr->attributeType == type)
+        {
+            return attr;
+        }
+
+        if (attr->attributeType == $END)
+        {
+            break;
+        }
+
+        ptr += attr->length;
+    }
+    return nullptr;
+}
+
+void NTFSDirectorySystem::_parseMFT(DiskHandle *disk, bool rescan)
+{
+    NonresidentAttribute *dataAttribute;
+    uint32_t index = 0;
+
+    if (disk && disk->type == eNTFS_DISK)
+    {
+        FILE_RECORD_SEGMENT_HEADER *fh = (FILE_RECORD_SEGMENT_HEADER *)(disk->NTFS.mft);
+        _fixFileRecord(fh);
+        // fixRecord2(disk->NTFS.mft, disk->NTFS.recordSize, disk->bootBlock.PackedBpb.BytesPerSector);
+
+        if (!rescan)
+        {
+            disk->names.clear();
+        }
+
+        // the journal position is taken before the scan, so changes made while it runs
+        // are replayed on the next reload
+        UsnJournal journal;
+        std::vector<uint8_t> record;
+        disk->usnJournalRecord = 0;
+        bool journalRead = _readJournalState(disk, journal, record);
+
+        dataAttribute = _findAttribute(fh, $DATA);
+        if (dataAttribute)
+        {
+            _readMFTParse(disk, dataAttribute, 0, uint32_t(dataAttribute->highVcn) + 1, nullptr, rescan);
+        }
+
+        // not in the $Extend index root, look it up in the parsed table
+        if (!journalRead && disk->usnJournalRecord == 0)
+        {
+            journalRead = _readJournalState(disk, journal, record);
+        }
+
+        disk->usnJournalId = journalRead ? journal.journalId : 0;
+        disk->usnCursor = journalRead ? journal.nextUsn : 0;
+    }
+}
+
+// Splits the MFT data runs into reads of at most CLUSTERS_PER_READ clusters.
+// A reader thread keeps _readsInFlight of them queued on the volume and passes completed
+// buffers to this thread, which parses them while the reader refills the ring. Scan time
+// is then bounded by the slower of the two rather than their sum.
+//
+// With more than one parser thread each buffer is cut into record ranges that the workers
+// parse independently; every record has its own FileEntry slot, and names and fix lists go
+// to the worker's ParseContext until the scan is finished.
+
+uint32_t NTFSDirectorySystem::_readMFTParse(DiskHandle *disk, NonresidentAttribute *attr, uint64_t vcn, uint32_t count,
+                                            FetchProcedure fetch, bool rescan)
+{
+    uint64_t lcn, runcount;
+    uint32_t readcount, left;
+    uint32_t ret = 0;
+
+    uint32_t bytesPerCluster = disk->NTFS.bytesPerCluster;
+    uint32_t bytesPerFileRecord = disk->NTFS.bytesPerFileRecord;
+
+    disk->files.resize(disk->NTFS.entryCount);
+
+    if (_collectFileDetails)
+    {
+        disk->details.resize(disk->NTFS.entryCount);
+    }
+
+    // a rescan compares every record with its stamp, records past the old end of the MFT
+    // get empty stamps and count as changed
+    if (_incrementalRescan || rescan)
+    {
+        disk->stamps.resize(disk->NTFS.entryCount);
+    }
+
+    std::vector<MFTChunk> chunks;
+
+    for (left = count; left > 0; left -= readcount)
+    {
+        if (!_findRun(attr, vcn, &lcn, &runcount))
+        {
+            break;
+        }
+
+        readcount = uint32_t(std::min(std::min(runcount, (uint64_t)left), (uint64_t)CLUSTERS_PER_READ));
+
+        MFTChunk chunk;
+        chunk.offset = lcn * bytesPerCluster;
+        chunk.size = readcount * bytesPerCluster;
+        chunk.firstRecord = uint32_t(vcn * bytesPerCluster / bytesPerFileRecord);
+
+        // the allocation can run past the initialized part of the MFT
+        if (chunk.firstRecord >= disk->NTFS.entryCount)
+        {
+            break;
+        }
+        chunk.size = uint32_t(std::min((uint64_t)chunk.size,
+                                       uint64_t(disk->NTFS.entryCount - chunk.firstRecord) * bytesPerFileRecord));
+
+        chunks.push_back(chunk);
+        vcn += readcount;
+    }
+
+    uint32_t records = 0;
+    if (!chunks.empty())
+    {
+        records = chunks.back().firstRecord + chunks.back().size / bytesPerFileRecord;
+    }
+
+    if (!disk->scanDeleted)
+    {
+        _skipUnusedRecords(disk, chunks);
+    }
+
+    String scanText("Reading Drive ");
+    scanText += disk->label;
+
+    AsyncReadQueue *queue = disk->source->createReadQueue(_readsInFlight);
+
+    // every queued read owns a buffer, plus two so that parsing never waits for a free one
+    std::vector<std::vector<uint8_t>> buffers(queue->depth() + 2);
+
+    BlockingQueue<uint8_t *> idle;
+    BlockingQueue<MFTBuffer> filled;
+
+    for (auto &buffer : buffers)
+    {
+        buffer.resize(CLUSTERS_PER_READ * bytesPerCluster);
+        idle.push(buffer.data());
+    }
+
+    std::thread reader([&]() {
+        std::deque<MFTChunk const *> inFlight;
+
+        auto completeOldest = [&]() {
+            MFTBuffer result;
+            void *data = nullptr;
+            result.chunk = inFlight.front();
+            inFlight.pop_front();
+            queue->complete(&data, &result.read);
+            result.data = (uint8_t *)data;
+            filled.push(result);
+        };
+
+        for (auto const &chunk : chunks)
+        {
+            if (chunk.offset == 0)
+            {
+                // sparse run, no records
+                continue;
+            }
+
+            uint8_t *buffer = nullptr;
+            while (queue->pending() == queue->depth() || (queue->pending() > 0 && !idle.tryPop(buffer)))
+            {
+                completeOldest();
+            }
+
+            if (buffer == nullptr)
+            {
+                idle.pop(buffer);
+            }
+
+            queue->submit(chunk.offset, buffer, chunk.size);
+            inFlight.push_back(&chunk);
+        }
+
+        while (!inFlight.empty())
+        {
+            completeOldest();
+        }
+
+        filled.close();
+    });
+
+    std::vector<ParseContext> contexts(_parserThreads);
+    for (auto &context : contexts)
+    {
+        context.names = NameArena::Cursor(&disk->names);
+        context.rescan = rescan;
+    }
+
+    MFTBuffer item;
+
+    if (contexts.size() == 1)
+    {
+        uint32_t parsed = 0;
+
+        while (filled.pop(item))
+        {
+            _processBuffer(disk, &contexts[0], item.data, item.read, item.chunk->firstRecord, fetch);
+            idle.push(item.data);
+
+            ret += item.read;
+            parsed += item.chunk->size / bytesPerFileRecord;
+
+            _signalProgress(disk, parsed, disk->NTFS.entryCount, scanText);
+        }
+    }
+    else
+    {
+        BlockingQueue<ParseRange> work;
+        std::atomic<uint32_t> parsed(0);
+
+        std::vector<std::thread> workers;
+        for (auto &context : contexts)
+        {
+            ParseContext *workerContext = &context;
+            workers.emplace_back([&, workerContext]() {
+                ParseRange range;
+                while (work.pop(range))
+                {
+                    _processBuffer(disk, workerContext, range.data, range.size, range.firstRecord, fetch);
+                    parsed += range.size / bytesPerFileRecord;
+
+                    // the last range of a buffer gives it back to the reader
+                    if (range.owner->remaining.fetch_sub(1) == 1)
+                    {
+                        idle.push(range.owner->data);
+                        delete range.owner;
+                    }
+                }
+            });
+        }
+
+        uint32_t ranges = uint32_t(contexts.size());
+
+        while (filled.pop(item))
+        {
+            uint32_t records = item.read / bytesPerFileRecord;
+            uint32_t perRange = std::max((records + ranges - 1) / ranges, (uint32_t)MIN_RECORDS_PER_RANGE);
+
+            ret += item.read;
 
-                    hits++;
-                }
+            if (records == 0)
+            {
+                idle.push(item.data);
+                continue;
             }
-            if ((i % 1000) == 0)
+
+            SharedBuffer *owner = new SharedBuffer;
+            owner->data = item.data;
+            owner->remaining = (records + perRange - 1) / perRange;
+
+            for (uint32_t first = 0; first < records; first += perRange)
             {
-                signalDirectoryProgress(0, disk->filesSize, searchText);
+                ParseRange range;
+                range.owner = owner;
+                range.data = item.data + first * bytesPerFileRecord;
+                range.size = std::min(perRange, records - first) * bytesPerFileRecord;
+                range.firstRecord = item.chunk->firstRecord + first;
+                work.push(range);
             }
+
+            _signalProgress(disk, parsed, disk->NTFS.entryCount, scanText);
         }
-        signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
+
+        work.close();
+
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        _signalProgress(disk, parsed, disk->NTFS.entryCount, scanText);
     }
-    else
+
+    reader.join();
+
+    delete queue;
+
+    // fixes can point at names written by another thread
+    if (!rescan)
     {
-        for (auto i = 0ul; i < disk->filesSize; i++)
+        for (auto &context : contexts)
         {
-            if (deleted || (info[i].flags & IN_USE))
-            {
-                if (info[i].fileName != nullptr)
-                {
+            disk->realFiles += context.realFiles;
+        }
+    }
 
-                    if (!(info[i].flags & IS_DIRECTORY))
-                    {
-                        std::wstring fileName(info[i].fileName);
-                        std::wstring path = _path(disk, i);
+    _applyFixups(disk, contexts);
 
-                        _saveFileName(path, fileName);
-                    }
+    if (rescan)
+    {
+        _applyRescan(disk, contexts);
+        disk->filesSize = records;
 
-                    hits++;
-                }
+        _signalProgress(disk, disk->NTFS.entryCount, disk->NTFS.entryCount, scanText);
+        return ret;
+    }
+
+    // each worker saw records in order, but the ranges of different workers and the
+    // fixed up base records interleave
+    for (auto &context : contexts)
+    {
+        for (uint32_t slot = 0; slot < context.extensions.size(); slot++)
+        {
+            std::wstring const &key = context.extensions.key(slot);
+            uint32_t diskSlot = disk->extensions.add(key.data(), uint32_t(key.length()));
+
+            if (diskSlot == disk->extensionFiles.size())
+            {
+                disk->extensionFiles.emplace_back();
             }
+
+            auto &add = context.extensionFiles[slot];
+            disk->extensionFiles[diskSlot].append(add.data(), add.data() + add.size());
         }
+        context.extensions.clear();
+        context.extensionFiles.clear();
     }
 
-    return hits;
+    for (auto &ids : disk->extensionFiles)
+    {
+        std::sort(ids.begin(), ids.end());
+    }
+
+    disk->filesSize = records;
+
+    _signalProgress(disk, disk->NTFS.entryCount, disk->NTFS.entryCount, scanText);
+
+    return ret;
 }
 
-int NTFSDirectorySystem::_gatherAllDirectories(DiskHandle *disk, bool deleted)
+// Drops the parts of the chunks whose records are all free in the $MFT bitmap.
+// Free stretches shorter than MIN_SKIP_BYTES stay in the read, a separate request costs
+// more than reading through them.
+
+void NTFSDirectorySystem::_skipUnusedRecords(DiskHandle *disk, std::vector<MFTChunk> &chunks)
 {
-    int hits = 0;
-    bool res = 0;
-    auto &info = disk->fileInfo;
+    if (disk->mftBitmap.empty())
+    {
+        return;
+    }
 
-    String searchText("Searching Drive ");
-    searchText += disk->dosDevice;
-    searchText += ":\\";
+    uint32_t bytesPerFileRecord = disk->NTFS.bytesPerFileRecord;
 
-    if (!_blackList.empty())
+    // smallest piece that can be left out: a cluster, or a record if records span clusters
+    uint32_t unit = std::max(disk->NTFS.bytesPerCluster, bytesPerFileRecord);
+    uint32_t recordsPerUnit = unit / bytesPerFileRecord;
+
+    std::vector<MFTChunk> used;
+
+    for (auto const &chunk : chunks)
     {
-        for (auto i = 0ul; i < disk->filesSize; i++)
+        if (chunk.offset == 0)
         {
-            if (deleted || (info[i].flags & IN_USE))
-            {
-                if (info[i].fileName != nullptr)
-                {
-                    std::wstring fileName(info[i].fileName);
+            used.push_back(chunk);
+            continue;
+        }
 
-                    std::wstring path = _path(disk, i);
+        uint32_t units = (chunk.size + unit - 1) / unit;
+        int64_t start = -1;
+        uint32_t end = 0;
 
-                    bool onBlackList = false;
-                    for (auto &blackName : _blackList)
-                    {
-                        if (_startsWith(path, blackName))
-                        {
-                            onBlackList = true;
-                            break;
-                        }
-                    }
+        auto emit = [&]() {
+            MFTChunk part;
+            part.offset = chunk.offset + uint64_t(start) * unit;
+            part.size = std::min(end * unit, chunk.size) - uint32_t(start) * unit;
+            part.firstRecord = chunk.firstRecord + uint32_t(start) * recordsPerUnit;
+            used.push_back(part);
+        };
 
-                    if (onBlackList)
-                    {
-                        continue;
-                    }
+        for (uint32_t u = 0; u < units; u++)
+        {
+            uint32_t first = chunk.firstRecord + u * recordsPerUnit;
 
-                    if (info[i].flags & IS_DIRECTORY)
-                    {
-                        if (fileName != L"." && fileName != L"..")
-                        {
-                            _saveFileName(path, fileName);
-                        }
-                    }
+            bool inUse = false;
+            for (uint32_t r = 0; r < recordsPerUnit && !inUse; r++)
+            {
+                inUse = _recordInUse(disk, first + r);
+            }
 
-                    hits++;
-                }
+            if (!inUse)
+            {
+                continue;
             }
 
-            if ((i % 1000) == 0)
+            if (start < 0)
             {
-                signalDirectoryProgress(0, disk->filesSize, searchText);
+                start = u;
+            }
+            else if ((u - end) * uint64_t(unit) >= MIN_SKIP_BYTES)
+            {
+                emit();
+                start = u;
             }
+            end = u + 1;
+        }
+
+        if (start >= 0)
+        {
+            emit();
         }
-        signalDirectoryProgress(disk->filesSize, disk->filesSize, searchText);
     }
-    else
+
+    chunks.swap(used);
+}
+
+bool NTFSDirectorySystem::_recordInUse(DiskHandle *disk, uint32_t id)
+{
+    // records past the end of the bitmap are read anyway
+    if ((id >> 3) >= disk->mftBitmap.size())
     {
-        for (auto i = 0ul; i < disk->filesSize; i++)
+        return true;
+    }
+    return (disk->mftBitmap[id >> 3] >> (id & 7)) & 1;
+}
+
+// Reads the whole value of an attribute, resident or not. Sparse runs read as zeros.
+
+bool NTFSDirectorySystem::_readAttribute(DiskHandle *disk, Attribute *attribute, std::vector<uint8_t> &data)
+{
+    if (!attribute->nonresident)
+    {
+        ResidentAttribute *resident = (ResidentAttribute *)attribute;
+        uint8_t *value = (uint8_t *)resident + resident->valueOffset;
+        data.assign(value, value + resident->valueLength);
+        return true;
+    }
+
+    NonresidentAttribute *attr = (NonresidentAttribute *)attribute;
+    uint32_t bytesPerCluster = disk->NTFS.bytesPerCluster;
+
+    data.assign(size_t(attr->allocatedSize), 0);
+
+    uint64_t lcn, runcount;
+    for (uint64_t vcn = attr->lowVcn; vcn <= attr->highVcn; vcn += runcount)
+    {
+        if (!_findRun(attr, vcn, &lcn, &runcount) || runcount == 0)
         {
-            if (deleted || (info[i].flags & IN_USE))
-            {
-                if (info[i].fileName != nullptr)
-                {
+            return false;
+        }
 
-                    if (info[i].flags & IS_DIRECTORY)
-                    {
-                        std::wstring fileName(info[i].fileName);
-                        std::wstring path = _path(disk, i);
-                        _saveFileName(path, fileName);
-                    }
+        uint64_t position = (vcn - attr->lowVcn) * bytesPerCluster;
+        if (position >= data.size())
+        {
+            break;
+        }
 
-                    hits++;
-                }
+        uint32_t size = uint32_t(std::min(runcount * bytesPerCluster, data.size() - position));
+
+        if (lcn != 0)
+        {
+            uint32_t read = 0;
+            if (!disk->source->read(lcn * bytesPerCluster, data.data() + position, size, &read) || read != size)
+            {
+                return false;
             }
         }
     }
 
-    return hits;
-}
-void NTFSDirectorySystem::_addToFixList(int entry, int data)
-{
-    curfix->entry = entry;
-    curfix->data = data;
-    curfix->next = new LinkItem;
-    curfix = curfix->next;
-    curfix->next = nullptr;
+    data.resize(size_t(std::min(attr->dataSize, (uint64_t)data.size())));
+    return true;
 }
 
-void NTFSDirectorySystem::_createFixList()
+uint32_t NTFSDirectorySystem::_runLength(uint8_t *run)
 {
-    fixlist = new LinkItem;
-    fixlist->next = nullptr;
-    curfix = fixlist;
+    // i guess it must be this way
+    return (*run & 0xf) + ((*run >> 4) & 0xf) + 1;
 }
 
-void NTFSDirectorySystem::_processFixList(DiskHandle *disk)
+int64_t NTFSDirectorySystem::_runLCN(uint8_t *run)
 {
-    while (fixlist->next != nullptr)
+    uint8_t n1 = *run & 0xf;
+    uint8_t n2 = (*run >> 4) & 0xf;
+    int64_t lcn = n2 == 0 ? 0 : char(run[n1 + n2]);
+
+    for (int32_t i = n1 + n2 - 1; i > n1; i--)
     {
-        auto &info = disk->fileInfo[fixlist->entry];
-        auto &src = disk->fileInfo[fixlist->data];
-        info.fileName = src.fileName;
-        info.fileNameLength = src.fileNameLength;
+        lcn = (lcn << 8) + run[i];
+    }
+    return lcn;
+}
 
-        info.parentId = src.parentId;
+uint64_t NTFSDirectorySystem::_runCount(uint8_t *run)
+{
+    // count the runs we have to process
+    uint8_t k = *run & 0xf;
+    uint64_t count = 0;
 
-        LinkItem *item;
-        item = fixlist;
-        fixlist = fixlist->next;
-        delete item;
+    for (uint32_t i = k; i > 0; i--)
+    {
+        count = (count << 8) + run[i];
     }
-    fixlist = nullptr;
-    curfix = nullptr;
+
+    return count;
 }
 
-void NTFSDirectorySystem::clearBlackList()
+bool NTFSDirectorySystem::_findRun(NonresidentAttribute *attr, uint64_t vcn, uint64_t *lcn, uint64_t *count)
 {
-    _blackList.clear();
+    if (vcn < attr->lowVcn || vcn > attr->highVcn)
+        return false;
+    *lcn = 0;
+
+    uint64_t base = attr->lowVcn;
+
+    for (uint8_t *run = (uint8_t *)((uint8_t *)(attr) + attr->runArrayOffset); *run != 0; run += _runLength(run))
+    {
+        *lcn += _runLCN(run);
+        *count = _runCount(run);
+        if (base <= vcn && vcn < base + *count)
+        {
+            *lcn = _runLCN(run) == 0 ? 0 : *lcn + vcn - base;
+            *count -= uint32_t(vcn - base);
+            return true;
+        }
+        else
+        {
+            base += *count;
+        }
+    }
+
+    return false;
 }
 
-void NTFSDirectorySystem::addToBlackList(String const &directory)
+void NTFSDirectorySystem::_processBuffer(DiskHandle *disk, ParseContext *context, uint8_t *buffer, uint32_t size,
+                                         uint32_t firstRecord, FetchProcedure fetch)
 {
-    _blackList.push_back(toStdWString(directory));
-}
+    uint8_t *end;
 
-#include <strsafe.h>
+    // whole records only, a short read can end mid record
+    end = (uint8_t *)(buffer) + (size / disk->NTFS.bytesPerFileRecord) * disk->NTFS.bytesPerFileRecord;
 
-void ErrorMessage(LPTSTR lpszFunction)
-{
-    // Retrieve the system error message for the last-error code
+    uint32_t n = firstRecord;
 
-    LPVOID lpMsgBuf;
-    LPVOID lpDisplayBuf;
-    DWORD dw = GetLastError();
+    while (buffer < end)
+    {
+        FILE_RECORD_SEGMENT_HEADER *fh = (FILE_RECORD_SEGMENT_HEADER *)(buffer);
 
-    FormatMessage(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, dw,
-                  MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT), (LPTSTR)&lpMsgBuf, 0, NULL);
+        if ((disk->scanDeleted || _recordInUse(disk, n)) && (!context->rescan || _recordChanged(disk, context, fh, n)))
+        {
+            if (!disk->stamps.empty())
+            {
+                disk->stamps[n].lsn = uint64_t(fh->Lsn.QuadPart);
+                disk->stamps[n].sequenceNumber = fh->SequenceNumber;
+            }
 
-    // Display the error message and exit the process
+            _fixFileRecord(fh);
+            // fixRecord2(buffer, disk->NTFS.recordSize, disk->bootBlock.PackedBpb.BytesPerSector);
 
-    lpDisplayBuf = (LPVOID)LocalAlloc(
-        LMEM_ZEROINIT, (lstrlen((LPCTSTR)lpMsgBuf) + lstrlen((LPCTSTR)lpszFunction) + 40) * sizeof(TCHAR));
-    StringCchPrintf((LPTSTR)lpDisplayBuf, LocalSize(lpDisplayBuf) / sizeof(TCHAR), TEXT("%s failed with error %d: %s"),
-                    lpszFunction, dw, lpMsgBuf);
-    MessageBox(NULL, (LPCTSTR)lpDisplayBuf, TEXT("Error"), MB_OK);
+            if (_fetchSearchInfo(disk, context, fh, n))
+            {
+                context->realFiles++;
+            }
+        }
+        buffer += disk->NTFS.bytesPerFileRecord;
 
-    LocalFree(lpMsgBuf);
-    LocalFree(lpDisplayBuf);
-    // ExitProcess(dw);
+        n++;
+    }
 }
 
-// NONRESIDENT_ATTRIBUTE ERROR_ATTRIBUTE = {1,2,3,4,5};
-#define CLUSTERS_PER_READ 1024
-DiskHandle *NTFSDirectorySystem::_openDisk(wchar_t dosDevice)
+// Directory of record id, with a trailing backslash.
+// Directory paths are built once and kept in disk->pathCache, so the hits in one folder
+// share a single walk up the parent chain. Only the part of the chain that is not cached
+// yet is walked, at most 64 levels as before.
+
+std::wstring const &NTFSDirectorySystem::_path(DiskHandle *disk, uint32_t id)
 {
-    wchar_t path[8];
-    path[0] = L'\\';
-    path[1] = L'\\';
-    path[2] = L'.';
-    path[3] = L'\\';
-    path[4] = dosDevice;
-    path[5] = L':';
-    path[6] = L'\0';
-    DiskHandle *disk;
-    disk = _openDisk(path);
-    if (disk != nullptr)
+    return _directoryPath(disk, disk->files[id].parent);
+}
+
+std::wstring const &NTFSDirectorySystem::_directoryPath(DiskHandle *disk, uint32_t directory)
+{
+    auto &cache = disk->pathCache;
+
+    auto found = cache.find(directory);
+    if (found != cache.end())
     {
-        disk->dosDevice = dosDevice;
-        return disk;
+        return found->second;
     }
-    return nullptr;
-}
 
-#define BUFFER_SIZE (1024 * 1024)
+    uint32_t PathStack[64];
+    int PathStackPos = 0;
 
-/*
-FILE_ID_DESCRIPTOR getFileIdDescriptor(const DWORDLONG fileId)
-{
-    FILE_ID_DESCRIPTOR fileDescriptor;
-    fileDescriptor.Type = FileIdType;
-    fileDescriptor.FileId.QuadPart = fileId;
-    fileDescriptor.dwSize = sizeof(fileDescriptor);
-    return fileDescriptor;
+    std::wstring const *base = nullptr;
+    uint32_t a = directory;
+
+    for (int i = 0; i < 64; i++)
+    {
+        if (a == 0 || a == 5 || a >= disk->files.size())
+        {
+            break;
+        }
+
+        found = cache.find(a);
+        if (found != cache.end())
+        {
+            base = &found->second;
+            break;
+        }
+
+        PathStack[PathStackPos++] = a;
+
+        a = disk->files[a].parent;
+    }
+
+    if (base == nullptr)
+    {
+        std::wstring root;
+        if (disk->dosDevice != 0)
+        {
+            root.push_back(disk->dosDevice);
+            root.push_back(L':');
+        }
+        root.push_back(L'\\');
+
+        base = &cache.emplace(5, root).first->second;
+    }
+
+    for (int i = PathStackPos - 1; i >= 0; i--)
+    {
+        uint32_t pt = PathStack[i];
+
+        FileEntry const &entry = disk->files[pt];
+
+        std::wstring path(*base);
+        path.append(disk->name(entry), entry.nameLength);
+        path.push_back(L'\\');
+
+        base = &cache.emplace(pt, std::move(path)).first->second;
+    }
+
+    return *base;
 }
-*/
-DiskHandle *NTFSDirectorySystem::_openDisk(wchar_t const *disk)
+
+uint32_t NTFSDirectorySystem::_allocateString(ParseContext *context, wchar_t *fileName, int length)
 {
-    unsigned long read1;
-    unsigned long read2;
-    unsigned long read3;
+    return context->names.allocate(fileName, length);
+}
 
-    DiskHandle *tmpDisk = new DiskHandle;
+// Fills the FileEntry of record id from its first Win32 name. Parsing stops there unless
+// file details are collected, then the rest of the attributes are walked as well.
+
+bool NTFSDirectorySystem::_fetchSearchInfo(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file,
+                                           uint32_t id)
+{
+    FILE_NAME *fn;
+    uint8_t *ptr = (uint8_t *)(file) + file->FirstAttributeOffset;
 
-    tmpDisk->fileHandle =
-        CreateFile(disk, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+    FileEntry *entry = &disk->files[id];
+    LongFileInfo *details = disk->details.empty() ? nullptr : &disk->details[id];
+    bool named = false;
 
-    if (tmpDisk->fileHandle != INVALID_HANDLE_VALUE)
+    if (strncmp((char *)file->MultiSectorHeader.Signature, "FILE", 4) == 0)
     {
+        // attributes moved out of a base record, the extension record is not a file itself
+        if (file->BaseFileRecordSegment.SegmentNumberLowPart != 0)
+        {
+            *entry = FileEntry();
+            _fetchExtension(disk, context, file, id);
+            return false;
+        }
 
-        int bbs = sizeof(PACKED_BOOT_SECTOR);
-        // int bbs2 = sizeof(NTFS_VOLUME_DATA_BUFFER);
-
-        LARGE_INTEGER pos;
-        pos.QuadPart = (LONGLONG)0;
-        LARGE_INTEGER result;
-        SetFilePointerEx(tmpDisk->fileHandle, pos, &result, SEEK_SET);
+        entry->flags = file->Flags;
 
-        PACKED_BOOT_SECTOR &bootBlock = tmpDisk->bootBlock;
+        while (true)
+        {
+            if (ptr + sizeof(ResidentAttribute) > LPBYTE(file) + disk->NTFS.recordSize)
+            {
+                break;
+            }
 
-        BOOL b1 = ReadFile(tmpDisk->fileHandle, &bootBlock, sizeof(PACKED_BOOT_SECTOR), &read1, NULL);
+            ResidentAttribute *residentAttribute = (ResidentAttribute *)ptr;
 
-        BOOL b2 = DeviceIoControl(tmpDisk->fileHandle,        // handle to device
-                                  FSCTL_GET_NTFS_VOLUME_DATA, // dwIoControlCodeNULL,
-                                  nullptr, 0, &tmpDisk->NTFS.volumeData, sizeof(NTFS_VOLUME_DATA),
-                                  &read2,   // size of output buffer
-                                  nullptr); // OVERLAPPED structure
+            if (residentAttribute->attributeType == $END)
+            {
+                break;
+            }
 
-        char const *name = (const char *)&tmpDisk->bootBlock.Oem;
-        assert(bootBlock.signature = 0xAA55);
-        if ((read1 == sizeof(PACKED_BOOT_SECTOR)) && (read2 == sizeof(NTFS_VOLUME_DATA)) && b1 && b2)
-        {
-            if (strncmp("NTFS", (const char *)&tmpDisk->bootBlock.Oem, 4) == 0)
+            switch (residentAttribute->attributeType)
             {
+                case $FILE_NAME:
+                    fn = (FILE_NAME *)(ptr + residentAttribute->valueOffset);
+                    if (!named && (fn->Flags & FILE_NAME_NTFS || fn->Flags == 0))
+                    {
+                        entry->nameOffset = _allocateString(context, fn->FileName, fn->FileNameLength);
+                        entry->nameLength = (uint16_t)fn->FileNameLength;
+                        entry->parent = fn->ParentDirectory.SegmentNumberLowPart;
+
+                        // a rescan updates the disk's lists once the records are read
+                        if (!(file->Flags & IS_DIRECTORY) && !context->rescan)
+                        {
+                            _indexExtension(context, fn->FileName, fn->FileNameLength, id);
+                        }
+
+                        if (details == nullptr)
+                        {
+                            return true;
+                        }
+                        named = true;
+                    }
+                    break;
+
+                case $DATA:
+                case $STANDARD_INFORMATION:
+                    if (details != nullptr)
+                    {
+                        _fetchDetails(disk, residentAttribute, details);
+                    }
+                    break;
 
-                tmpDisk->type = eNTFS_DISK;
+                case $ATTRIBUTE_LIST:
+                case $BITMAP:
+                case $OBJECT_ID:                    // 0x40,
+                case $SECURITY_DESCRIPTOR:          // 0x50,
+                case $VOLUME_NAME:                  // 0x60,
+                case $VOLUME_INFORMATION:           // 0x70,
+                case $INDEX_ROOT:                   // 0x90,
+                case $INDEX_ALLOCATION:             // 0xA0,
+                case $SYMBOLIC_LINK:                // 0xC0,
+                case $EA_INFORMATION:               // 0xD0,
+                case $EA:                           // 0xE0,
+                case $FIRST_USER_DEFINED_ATTRIBUTE: // 0x100
+                    break;
 
-                auto &volumeData = tmpDisk->NTFS.volumeData;
+                default:
+                    break;
+            }
 
-                tmpDisk->NTFS.bytesPerCluster = volumeData.BytesPerCluster;
-                tmpDisk->NTFS.bytesPerFileRecord = volumeData.BytesPerFileRecordSegment;
+            if (residentAttribute->length == 0)
+            {
+                break;
+            }
+            ptr += residentAttribute->length;
+        }
+    }
+    return named;
+}
 
-                tmpDisk->NTFS.complete = false;
-                tmpDisk->NTFS.mftLocation = volumeData.MftStartLcn.QuadPart * volumeData.BytesPerCluster;
+// the name and sizes an extension record holds for its base, if any
+void NTFSDirectorySystem::_fetchExtension(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file,
+                                          uint32_t id)
+{
+    Fixup fixup;
+    fixup.base = file->BaseFileRecordSegment.SegmentNumberLowPart;
+    fixup.extension = id;
+    fixup.flags = (file->Flags & IN_USE) ? FIXUP_IN_USE : 0;
 
-                tmpDisk->NTFS.mft = nullptr;
+    uint8_t *ptr = (uint8_t *)(file) + file->FirstAttributeOffset;
+    uint8_t *end = (uint8_t *)(file) + disk->NTFS.recordSize;
 
-                tmpDisk->NTFS.sizeMFT = 0;
+    while (ptr + sizeof(ResidentAttribute) <= end)
+    {
+        ResidentAttribute *attribute = (ResidentAttribute *)ptr;
 
-                // volumeData.ClustersPerFileRecordSegment is reading zero
+        if (attribute->attributeType == $END || attribute->length == 0)
+        {
+            break;
+        }
 
-                tmpDisk->NTFS.recordSize = tmpDisk->bootBlock.ClustersPerFileRecordSegment * volumeData.BytesPerCluster;
-                int t = 1;
+        if (attribute->attributeType == $FILE_NAME && !attribute->nonresident && fixup.nameLength == 0)
+        {
+            FILE_NAME *fn = (FILE_NAME *)(ptr + attribute->valueOffset);
+            if (fn->Flags & FILE_NAME_NTFS || fn->Flags == 0)
+            {
+                fixup.nameOffset = _allocateString(context, fn->FileName, fn->FileNameLength);
+                fixup.nameLength = fn->FileNameLength;
+                fixup.parent = fn->ParentDirectory.SegmentNumberLowPart;
             }
         }
-        else
+        else if (attribute->attributeType == $DATA && attribute->nameLength == 0 && !disk->details.empty())
         {
-            tmpDisk->type = eUNKNOWN_DISK;
+            LongFileInfo extent;
+            _fetchDetails(disk, attribute, &extent);
+
+            // only the first extent of a stream carries its sizes
+            if (!attribute->nonresident || ((NonresidentAttribute *)attribute)->lowVcn == 0)
+            {
+                fixup.flags |= FIXUP_SIZE;
+                fixup.fileSize = extent.fileSize;
+                fixup.allocatedFileSize = extent.allocatedFileSize;
+            }
         }
-        return tmpDisk;
+
+        ptr += attribute->length;
     }
 
-    delete tmpDisk;
-    return nullptr;
+    if (fixup.nameLength != 0 || (fixup.flags & FIXUP_SIZE))
+    {
+        context->fixups.push_back(fixup);
+    }
 }
 
-void NTFSDirectorySystem::closeDisks()
+void NTFSDirectorySystem::_fetchDetails(DiskHandle *disk, ResidentAttribute *attribute, LongFileInfo *details)
 {
+    if (attribute->attributeType == $STANDARD_INFORMATION)
+    {
+        struct StandardInformation *si = (struct StandardInformation *)((uint8_t *)attribute + attribute->valueOffset);
 
-    for (int i = 0; i < 32; i++)
+        details->creationTime = si->creationTime;
+        details->accessTime = si->lastAccessTime;
+        details->writeTime = si->lastWriteTime;
+        details->changeTime = si->changeTime;
+        details->fileAttributes = si->fileAttributes;
+    }
+    else if (attribute->nameLength == 0) // the unnamed $DATA stream is the file content
     {
-        _closeDisk(disks[i]);
+        if (attribute->nonresident)
+        {
+            NonresidentAttribute *nonresident = (NonresidentAttribute *)attribute;
+
+            // only the first extent carries the sizes
+            if (nonresident->lowVcn == 0)
+            {
+                details->fileSize = nonresident->dataSize;
+                details->allocatedFileSize = nonresident->allocatedSize;
+            }
+        }
+        else
+        {
+            details->fileSize = attribute->valueLength;
+            details->allocatedFileSize = (attribute->valueLength + 7) & ~7ull;
+        }
     }
 }
 
-bool NTFSDirectorySystem::_closeDisk(DiskHandle *disk)
+bool NTFSDirectorySystem::_reparseDisk(DiskHandle *disk)
 {
     if (disk)
     {
-        if (disk->fileHandle > INVALID_HANDLE_VALUE)
-        {
-            CloseHandle(disk->fileHandle);
-        }
         if (disk->type == eNTFS_DISK)
         {
             if (disk->NTFS.mft)
             {
-                delete disk->NTFS.mft;
+                delete[] disk->NTFS.mft;
             }
             disk->NTFS.mft = nullptr;
-            // delete disk->NTFS.bitmap;
-            // disk->NTFS.bitmap = nullptr;
+
+            /*if (disk->NTFS.bitmap)
+            {
+                delete disk->NTFS.bitmap;
+            }
+            disk->NTFS.bitmap = nullptr;
+            */
         }
 
-        delete disk;
+        _dropDiskIndex(disk);
+
+        if (_loadMFT(disk, false) == 0)
+        {
+            return false;
+        }
+
+        _parseMFT(disk);
         return true;
     }
     return false;
 }
 
-uint64_t NTFSDirectorySystem::_loadMFT(DiskHandle *disk, bool complete)
+// Reads size bytes at offset of a nonresident attribute, sparse parts read as zeros.
+// The volume is only asked for whole clusters, live volumes take aligned requests only.
+
+bool NTFSDirectorySystem::_readAttributeRange(DiskHandle *disk, NonresidentAttribute *attr, uint64_t offset,
+                                              uint32_t size, uint8_t *buffer)
 {
-    if (disk == nullptr)
-    {
-        return 0;
-    }
+    uint32_t bytesPerCluster = disk->NTFS.bytesPerCluster;
+    std::vector<uint8_t> clusters;
 
-    if (disk->type == eNTFS_DISK)
+    while (size > 0)
     {
-        unsigned long read;
+        uint64_t vcn = offset / bytesPerCluster;
+        uint32_t within = uint32_t(offset % bytesPerCluster);
 
-        LARGE_INTEGER offset;
-        offset.QuadPart = disk->NTFS.mftLocation;
+        uint64_t lcn, runcount;
+        if (!_findRun(attr, vcn, &lcn, &runcount) || runcount == 0)
+        {
+            return false;
+        }
 
-        SetFilePointerEx(disk->fileHandle, offset, nullptr, FILE_BEGIN);
+        uint32_t piece = uint32_t(std::min<uint64_t>(size, runcount * bytesPerCluster - within));
 
-        uint8_t *buf = new uint8_t[disk->NTFS.bytesPerCluster];
-        ReadFile(disk->fileHandle, buf, disk->NTFS.bytesPerCluster, &read, nullptr);
+        if (lcn == 0)
+        {
+            memset(buffer, 0, piece);
+        }
+        else
+        {
+            uint32_t count = (within + piece + bytesPerCluster - 1) / bytesPerCluster;
+            clusters.resize(size_t(count) * bytesPerCluster);
 
-        FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)(buf);
+            uint32_t read = 0;
+            if (!disk->source->read(lcn * bytesPerCluster, clusters.data(), uint32_t(clusters.size()), &read) ||
+                read != clusters.size())
+            {
+                return false;
+            }
+            memcpy(buffer, clusters.data() + within, piece);
+        }
 
-        _fixFileRecord(file);
+        buffer += piece;
+        offset += piece;
+        size -= piece;
+    }
 
-        NonresidentAttribute *dataAttribute = _findAttribute(file, AttributeType_e::Data);
-        NonresidentAttribute *bitmapAttribute = _findAttribute(file, AttributeType_e::Bitmap);
+    return true;
+}
 
-        if (bitmapAttribute)
-        {
-            int t = 1;
-        }
+// one file record by number, located through the runs of $MFT
+bool NTFSDirectorySystem::_readRecord(DiskHandle *disk, uint32_t id, std::vector<uint8_t> &record)
+{
+    if (disk->NTFS.mft == nullptr)
+    {
+        return false;
+    }
 
-        disk->NTFS.sizeMFT = dataAttribute->dataSize;
-        disk->NTFS.mft = buf;
+    NonresidentAttribute *data = _findAttribute((FILE_RECORD_SEGMENT_HEADER *)disk->NTFS.mft, $DATA);
+    if (data == nullptr || uint64_t(id + 1) * disk->NTFS.bytesPerFileRecord > data->dataSize)
+    {
+        return false;
+    }
 
-        disk->NTFS.entryCount = disk->NTFS.sizeMFT / disk->NTFS.bytesPerFileRecord;
-        return dataAttribute->dataSize;
+    record.resize(disk->NTFS.bytesPerFileRecord);
+    if (!_readAttributeRange(disk, data, uint64_t(id) * disk->NTFS.bytesPerFileRecord, uint32_t(record.size()),
+                             record.data()))
+    {
+        return false;
     }
 
-    return 0;
+    FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)record.data();
+    return strncmp((char *)file->MultiSectorHeader.Signature, "FILE", 4) == 0 && _fixFileRecord(file);
 }
 
-NonresidentAttribute *NTFSDirectorySystem::_findAttribute(FILE_RECORD_SEGMENT_HEADER *file, int type)
+Attribute *NTFSDirectorySystem::_findNamedAttribute(FILE_RECORD_SEGMENT_HEADER *file, uint32_t recordSize, int type,
+                                                    wchar_t const *name)
 {
-    uint8_t *ptr = (uint8_t *)(file) + file->FirstAttributeOffset;
+    uint8_t *end = (uint8_t *)file + recordSize;
+    uint8_t *ptr = (uint8_t *)file + file->FirstAttributeOffset;
+    size_t length = wcslen(name);
 
-    for (int i = 1; i < file->BytesAvailable; i++)
+    while (ptr + sizeof(Attribute) <= end)
     {
-        NonresidentAttribute *attr = (NonresidentAttribute *)ptr;
-        if (attr->attributeType == type)
+        Attribute *attr = (Attribute *)ptr;
+
+        if (attr->attributeType == $END || attr->length == 0 || ptr + attr->length > end)
         {
-            return attr;
+            break;
         }
 
-        if (attr->attributeType == $END)
+        if (attr->attributeType == type && attr->nameLength == length &&
+            memcmp(ptr + attr->nameOffset, name, length * sizeof(wchar_t)) == 0)
         {
-            break;
+            return attr;
         }
 
         ptr += attr->length;
@@ -793,485 +2796,505 @@ NonresidentAttribute *NTFSDirectorySystem::_findAttribute(FILE_RECORD_SEGMENT_HE
     return nullptr;
 }
 
-void NTFSDirectorySystem::_parseMFT(DiskHandle *disk)
+// $UsnJrnl lives in $Extend (record 11). Before the first scan its number comes from the
+// $Extend index root, afterwards from the parsed tables.
+
+uint32_t NTFSDirectorySystem::_findJournalRecord(DiskHandle *disk)
 {
-    NonresidentAttribute *dataAttribute;
-    uint32_t index = 0;
+    static wchar_t const journalName[] = L"$UsnJrnl";
+    uint32_t journalLength = uint32_t(wcslen(journalName));
 
-    if (disk && disk->type == eNTFS_DISK)
+    if (disk->filesSize > 0)
     {
-        _createFixList();
-
-        FILE_RECORD_SEGMENT_HEADER *fh = (FILE_RECORD_SEGMENT_HEADER *)(disk->NTFS.mft);
-        _fixFileRecord(fh);
-        // fixRecord2(disk->NTFS.mft, disk->NTFS.recordSize, disk->bootBlock.PackedBpb.BytesPerSector);
-
-        disk->nameInfo.clear();
-
-        dataAttribute = _findAttribute(fh, $DATA);
-        if (dataAttribute)
+        for (uint32_t id = 0; id < disk->filesSize; id++)
         {
-            std::vector<uint8_t> buffer(CLUSTERS_PER_READ * disk->NTFS.bytesPerCluster);
-            _readMFTParse(disk, dataAttribute, 0, uint32_t(dataAttribute->highVcn) + 1, buffer.data(), nullptr);
+            FileEntry const &entry = disk->files[id];
+            if (entry.parent == 11 && entry.nameLength == journalLength &&
+                memcmp(disk->name(entry), journalName, journalLength * sizeof(wchar_t)) == 0)
+            {
+                return id;
+            }
         }
+        return 0;
     }
 
-    _processFixList(disk);
-}
+    std::vector<uint8_t> record;
+    if (!_readRecord(disk, 11, record))
+    {
+        return 0;
+    }
 
-uint32_t NTFSDirectorySystem::_readMFTParse(DiskHandle *disk, NonresidentAttribute *attr, uint64_t vcn, uint32_t count,
-                                            void *buffer, FetchProcedure fetch)
-{
-    uint64_t lcn, runcount;
-    uint32_t readcount, left;
-    uint32_t ret = 0;
-    uint8_t *bytes = (uint8_t *)(buffer);
+    FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)record.data();
+    ResidentAttribute *root = (ResidentAttribute *)_findNamedAttribute(file, uint32_t(record.size()), $INDEX_ROOT, L"$I30");
+    if (root == nullptr || root->nonresident)
+    {
+        return 0;
+    }
 
-    disk->fileInfo.resize(disk->NTFS.entryCount);
+    INDEX_ROOT *indexRoot = (INDEX_ROOT *)((uint8_t *)root + root->valueOffset);
+    uint8_t *end = (uint8_t *)&indexRoot->IndexHeader + indexRoot->IndexHeader.FirstFreeByte;
 
-    for (left = count; left > 0; left -= readcount)
+    for (INDEX_ENTRY *entry = NtfsFirstIndexEntry(&indexRoot->IndexHeader);
+         (uint8_t *)entry + sizeof(INDEX_ENTRY) <= end && !(entry->Flags & INDEX_ENTRY_END) && entry->Length != 0;
+         entry = NtfsNextIndexEntry(entry))
     {
-        _findRun(attr, vcn, &lcn, &runcount);
-        readcount = uint32_t(std::min((uint32_t)runcount, left));
-        uint32_t n = readcount * disk->NTFS.bytesPerCluster;
-        if (lcn == 0)
-        {
-            // spares file?
-            memset(bytes, 0, n);
-        }
-        else
+        if (entry->FileName.FileNameLength == journalLength &&
+            memcmp(entry->FileName.FileName, journalName, journalLength * sizeof(wchar_t)) == 0)
         {
-            ret += _readMFTLCN(disk, lcn, readcount, buffer, fetch);
+            return entry->FileReference.SegmentNumberLowPart;
         }
-        vcn += readcount;
-        bytes += n;
     }
 
-    return ret;
-}
-
-uint32_t NTFSDirectorySystem::_runLength(uint8_t *run)
-{
-    // i guess it must be this way
-    return (*run & 0xf) + ((*run >> 4) & 0xf) + 1;
+    // a big $Extend keeps its entries in index blocks, found after the scan instead
+    return 0;
 }
 
-int64_t NTFSDirectorySystem::_runLCN(uint8_t *run)
+bool NTFSDirectorySystem::_readJournalState(DiskHandle *disk, UsnJournal &journal, std::vector<uint8_t> &record)
 {
-    uint8_t n1 = *run & 0xf;
-    uint8_t n2 = (*run >> 4) & 0xf;
-    int64_t lcn = n2 == 0 ? 0 : char(run[n1 + n2]);
-
-    for (int32_t i = n1 + n2 - 1; i > n1; i--)
+    if (disk->usnJournalRecord == 0)
     {
-        lcn = (lcn << 8) + run[i];
+        disk->usnJournalRecord = _findJournalRecord(disk);
     }
-    return lcn;
-}
-
-uint64_t NTFSDirectorySystem::_runCount(uint8_t *run)
-{
-    // count the runs we have to process
-    uint8_t k = *run & 0xf;
-    uint64_t count = 0;
 
-    for (uint32_t i = k; i > 0; i--)
+    journal.record = disk->usnJournalRecord;
+    if (journal.record == 0 || !_readRecord(disk, journal.record, record))
     {
-        count = (count << 8) + run[i];
-    }
-
-    return count;
-}
-
-bool NTFSDirectorySystem::_findRun(NonresidentAttribute *attr, uint64_t vcn, uint64_t *lcn, uint64_t *count)
-{
-    if (vcn < attr->lowVcn || vcn > attr->highVcn)
         return false;
-    *lcn = 0;
-
-    uint64_t base = attr->lowVcn;
-
-    for (uint8_t *run = (uint8_t *)((uint8_t *)(attr) + attr->runArrayOffset); *run != 0; run += _runLength(run))
-    {
-        *lcn += _runLCN(run);
-        *count = _runCount(run);
-        if (base <= vcn && vcn < base + *count)
-        {
-            *lcn = _runLCN(run) == 0 ? 0 : *lcn + vcn - base;
-            *count -= uint32_t(vcn - base);
-            return true;
-        }
-        else
-        {
-            base += *count;
-        }
     }
 
-    return false;
-}
+    FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)record.data();
+    if (!(file->Flags & IN_USE))
+    {
+        return false;
+    }
 
-uint32_t NTFSDirectorySystem::_readMFTLCN(DiskHandle *disk, uint64_t lcn, uint32_t count, PVOID buffer,
-                                          FetchProcedure fetch)
-{
-    LARGE_INTEGER offset;
-    unsigned long read = 0;
-    uint32_t ret = 0;
-    uint32_t cnt = 0, c = 0, pos = 0;
+    ResidentAttribute *max = (ResidentAttribute *)_findNamedAttribute(file, uint32_t(record.size()), $DATA, L"$Max");
+    NonresidentAttribute *data =
+        (NonresidentAttribute *)_findNamedAttribute(file, uint32_t(record.size()), $DATA, L"$J");
 
-    offset.QuadPart = lcn * disk->NTFS.bytesPerCluster;
-    SetFilePointer(disk->fileHandle, offset.LowPart, &offset.HighPart, FILE_BEGIN);
+    if (max == nullptr || max->nonresident || max->valueLength < sizeof(UsnJournalMax) || data == nullptr ||
+        !data->nonresident)
+    {
+        return false;
+    }
 
-    cnt = count / CLUSTERS_PER_READ;
+    UsnJournalMax *info = (UsnJournalMax *)((uint8_t *)max + max->valueOffset);
 
-    String scanText("Reading Drive ");
-    scanText += disk->dosDevice;
-    scanText += ":\\";
+    journal.journalId = info->journalId;
+    journal.lowestValidUsn = uint64_t(std::max<int64_t>(info->lowestValidUsn, 0));
+    journal.nextUsn = data->dataSize;
 
-    for (uint32_t i = 0; i < cnt; ++i)
-    {
-        ReadFile(disk->fileHandle, buffer, CLUSTERS_PER_READ * disk->NTFS.bytesPerCluster, &read, nullptr);
-        c += CLUSTERS_PER_READ;
-        pos += read;
+    return journal.journalId != 0;
+}
 
-        _processBuffer(disk, (uint8_t *)buffer, read, fetch);
+// Brings the tables up to date from the changes logged in $UsnJrnl:$J since usnCursor.
+// The stream is read straight from the volume source, so images replay the same way.
+// Fails, leaving the disk for a full rescan, when there is no journal or it was
+// recreated or wrapped past the cursor since the tables were built. The whole range is
+// read and checked before anything is applied, so a replay that fails leaves the
+// tables as they were.
 
-        signalDirectoryProgress(disk->filesSize, disk->NTFS.entryCount, scanText);
+bool NTFSDirectorySystem::_replayJournal(DiskHandle *disk)
+{
+    if (disk->type != eNTFS_DISK || disk->usnJournalId == 0 || disk->filesSize == 0)
+    {
+        return false;
     }
 
-    ReadFile(disk->fileHandle, buffer, (count - c) * disk->NTFS.bytesPerCluster, &read, nullptr);
+    // $MFT may have grown, and its runs locate the journal record
+    if (_loadMFT(disk, false) == 0)
+    {
+        return false;
+    }
 
-    _processBuffer(disk, (uint8_t *)buffer, read, fetch);
+    UsnJournal journal;
+    std::vector<uint8_t> record;
+    if (!_readJournalState(disk, journal, record) || journal.journalId != disk->usnJournalId ||
+        disk->usnCursor < journal.lowestValidUsn || disk->usnCursor > journal.nextUsn)
+    {
+        return false;
+    }
 
-    signalDirectoryProgress(disk->filesSize, disk->NTFS.entryCount, scanText);
+    FILE_RECORD_SEGMENT_HEADER *file = (FILE_RECORD_SEGMENT_HEADER *)record.data();
+    NonresidentAttribute *data =
+        (NonresidentAttribute *)_findNamedAttribute(file, uint32_t(record.size()), $DATA, L"$J");
 
-    pos += read;
-    return pos;
-}
+    String replayText("Updating Drive ");
+    replayText += disk->label;
 
-void NTFSDirectorySystem::_processBuffer(DiskHandle *disk, uint8_t *buffer, uint32_t size, FetchProcedure fetch)
-{
-    uint8_t *end;
-    uint32_t count = 0;
+    std::vector<UsnChange> changes;
+    std::vector<wchar_t> names;
 
-    end = (uint8_t *)(buffer) + size;
+    auto collect = [&](uint32_t id, uint32_t parent, uint32_t reason, uint32_t attributes, uint8_t const *name,
+                       uint32_t bytes) {
+        UsnChange change;
+        change.id = id;
+        change.parent = parent;
+        change.reason = reason;
+        change.attributes = attributes;
+        change.nameOffset = uint32_t(names.size());
+        change.nameLength = bytes / sizeof(wchar_t);
+        names.insert(names.end(), (wchar_t const *)name, (wchar_t const *)name + change.nameLength);
+        changes.push_back(change);
+    };
 
-    LongFileInfo *longFileInfo = &disk->fileInfo[disk->filesSize];
+    const uint32_t blockSize = 1024 * 1024;
+    std::vector<uint8_t> block(blockSize);
 
-    int n = disk->filesSize;
+    uint64_t position = disk->usnCursor;
+    uint64_t end = journal.nextUsn;
 
-    while (buffer < end)
+    while (position < end)
     {
+        // whole clusters, a record cut at the end of a block is read again with the next one
+        uint64_t blockStart = position - position % disk->NTFS.bytesPerCluster;
+        uint32_t size = uint32_t(std::min<uint64_t>(blockSize, end - blockStart));
 
-        if (n == 4711315)
+        if (!_readAttributeRange(disk, data, blockStart, size, block.data()))
         {
-            int t = 1;
+            return false;
         }
 
-        FILE_RECORD_SEGMENT_HEADER *fh = (FILE_RECORD_SEGMENT_HEADER *)(buffer);
-        _fixFileRecord(fh);
-        // fixRecord2(buffer, disk->NTFS.recordSize, disk->bootBlock.PackedBpb.BytesPerSector);
+        uint64_t blockEnd = blockStart + size;
 
-        if (_fetchSearchInfo(disk, fh, longFileInfo))
+        while (position + sizeof(UsnRecordHeader) <= blockEnd)
         {
-            disk->realFiles++;
-        }
-        buffer += disk->NTFS.bytesPerFileRecord;
-
-        longFileInfo++;
-        disk->filesSize++;
-        n++;
-    }
-}
+            UsnRecordHeader *header = (UsnRecordHeader *)(block.data() + (position - blockStart));
 
-std::wstring NTFSDirectorySystem::_path(DiskHandle *disk, uint32_t id)
-{
-    uint64_t a = id;
-
-    uint32_t pt;
-    uint64_t PathStack[64];
-    memset(PathStack, 0, 64 * sizeof(uint64_t));
+            // padding at the end of a journal page
+            if (header->recordLength == 0)
+            {
+                position += 8;
+                continue;
+            }
 
-    int PathStackPos = 0;
+            if (header->recordLength < sizeof(UsnRecordHeader) || header->recordLength > 0x10000)
+            {
+                return false;
+            }
 
-    std::wstring parentDirectory;
-    PathStackPos = 0;
+            if (position + header->recordLength > blockEnd)
+            {
+                if (blockEnd == end)
+                {
+                    position = end;
+                }
+                break;
+            }
 
-    for (int i = 0; i < 64; i++)
-    {
-        PathStack[PathStackPos++] = a;
+            if (header->majorVersion == 2 && header->recordLength >= sizeof(UsnRecordV2))
+            {
+                UsnRecordV2 *usn = (UsnRecordV2 *)header;
+                if (uint32_t(usn->fileNameOffset) + usn->fileNameLength <= usn->recordLength)
+                {
+                    collect(uint32_t(usn->fileReferenceNumber), uint32_t(usn->parentFileReferenceNumber), usn->reason,
+                            usn->fileAttributes, (uint8_t *)usn + usn->fileNameOffset, usn->fileNameLength);
+                }
+            }
+            else if (header->majorVersion == 3 && header->recordLength >= sizeof(UsnRecordV3))
+            {
+                UsnRecordV3 *usn = (UsnRecordV3 *)header;
+                if (uint32_t(usn->fileNameOffset) + usn->fileNameLength <= usn->recordLength)
+                {
+                    collect(uint32_t(usn->fileReferenceNumber[0]), uint32_t(usn->parentFileReferenceNumber[0]),
+                            usn->reason, usn->fileAttributes, (uint8_t *)usn + usn->fileNameOffset,
+                            usn->fileNameLength);
+                }
+            }
 
-        LongFileInfo &sfi = disk->fileInfo[a];
+            // version 4 range records say nothing about names
+            position += (header->recordLength + 7) & ~7u;
+        }
 
-        ULARGE_INTEGER parent;
-        parent.HighPart = sfi.parentId.SegmentNumberHighPart;
-        parent.LowPart = sfi.parentId.SegmentNumberLowPart;
+        _signalProgress(disk, size_t(position - disk->usnCursor), size_t(end - disk->usnCursor), replayText);
+    }
 
-        a = parent.QuadPart;
+    bool directoriesChanged = false;
+    disk->changes.clear();
 
-        if (a == 0 || a == 5)
-        {
-            break;
-        }
-    }
-    if (disk->dosDevice != 0)
+    for (auto const &change : changes)
     {
-        parentDirectory.push_back(disk->dosDevice);
-        parentDirectory.push_back(L':');
+        directoriesChanged |= _applyUsnRecord(disk, &disk->replayNames, change.id, change.parent,
+                                              names.data() + change.nameOffset, change.nameLength, change.reason,
+                                              change.attributes);
     }
 
-    for (int i = PathStackPos - 1; i > 0; i--)
+    if (directoriesChanged)
     {
-        pt = PathStack[i];
-
-        parentDirectory.push_back(L'\\');
-
-        LongFileInfo &sfi = disk->fileInfo[pt];
-
-        parentDirectory.append(sfi.fileName, sfi.fileNameLength);
+        disk->pathCache.clear();
+        disk->excludedVersion = 0;
     }
 
-    parentDirectory.push_back(L'\\');
+    _finishChanges(disk);
+    disk->usnCursor = end;
 
-    return parentDirectory;
+    return true;
 }
 
-wchar_t *NTFSDirectorySystem::_allocateString(DiskHandle *disk, wchar_t *fileName, int length)
+// Applies one journal record; returns true if a directory was added, moved, renamed or
+// deleted, which invalidates cached paths and the blacklist bits.
+
+bool NTFSDirectorySystem::_applyUsnRecord(DiskHandle *disk, NameArena::Cursor *names, uint32_t id, uint32_t parent,
+                                          wchar_t const *name, uint32_t length, uint32_t reason, uint32_t attributes)
 {
-    if (length == 0)
+    bool directory = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+    if (reason & USN_REASON_FILE_DELETE)
     {
-        int t = 1;
+        if (id < disk->filesSize && (disk->files[id].flags & IN_USE))
+        {
+            disk->files[id].flags &= ~IN_USE;
+            disk->realFiles--;
+            disk->changes.removed.push_back(id);
+            return directory;
+        }
+        return false;
     }
-    length++;
-    wchar_t *mem = new wchar_t[length];
-
-    auto p = std::shared_ptr<wchar_t>(mem);
-    memcpy(mem, fileName, length * sizeof(wchar_t));
-    disk->nameInfo.push_back(p);
 
-    return mem;
-}
-
-bool NTFSDirectorySystem::_fetchSearchInfo(DiskHandle *disk, FILE_RECORD_SEGMENT_HEADER *file,
-                                           LongFileInfo *longFileInfo)
-{
-    FILE_NAME *fn;
-    uint8_t *ptr = (uint8_t *)(file) + file->FirstAttributeOffset;
-
-    if (strncmp((char *)file->MultiSectorHeader.Signature, "FILE", 4) == 0)
+    // the new name follows in its own record
+    if ((reason & USN_REASON_RENAME_OLD_NAME) || length == 0 || length > 0xffff)
     {
-        longFileInfo->flags = file->Flags;
+        return false;
+    }
 
-        while (true)
+    if (id >= disk->filesSize)
+    {
+        disk->files.resize(id + 1);
+        if (!disk->details.empty())
         {
-            if (ptr + sizeof(ResidentAttribute) > LPBYTE(file) + disk->NTFS.recordSize)
-            {
-                break;
-            }
+            disk->details.resize(id + 1);
+        }
+        disk->filesSize = id + 1;
+    }
 
-            ResidentAttribute *residentAttribute = (ResidentAttribute *)ptr;
+    FileEntry &entry = disk->files[id];
+    uint16_t flags = uint16_t(IN_USE | (directory ? IS_DIRECTORY : 0));
 
-            if (residentAttribute->attributeType == $END)
-            {
-                break;
-            }
+    if (entry.flags == flags && entry.parent == parent && entry.nameLength == length &&
+        memcmp(disk->name(entry), name, length * sizeof(wchar_t)) == 0)
+    {
+        return false;
+    }
 
-            switch (residentAttribute->attributeType)
-            {
-                case $FILE_NAME:
-                    fn = (FILE_NAME *)(ptr + residentAttribute->valueOffset);
-                    if (fn->Flags & FILE_NAME_NTFS || fn->Flags == 0)
-                    {
-                        fn->FileName[fn->FileNameLength] = L'\0';
+    bool changed = directory || (entry.flags & IS_DIRECTORY);
 
-                        longFileInfo->fileName = _allocateString(disk, fn->FileName, fn->FileNameLength);
-                        longFileInfo->fileNameLength = (uint16_t)fn->FileNameLength;
+    if (!(entry.flags & IN_USE))
+    {
+        disk->realFiles++;
+        disk->changes.added.push_back(id);
+    }
+    else
+    {
+        disk->changes.modified.push_back(id);
+    }
 
-                        // std::wstring fileName(longFileInfo->fileName);
+    _unindexFile(disk, id, entry);
 
-                        longFileInfo->parentId = fn->ParentDirectory;
+    entry.nameOffset = names->allocate(name, length);
+    entry.nameLength = uint16_t(length);
+    entry.parent = parent;
+    entry.flags = flags;
 
-                        if (file->BaseFileRecordSegment.SegmentNumberLowPart != 0)
-                        {
-                            _addToFixList(file->BaseFileRecordSegment.SegmentNumberLowPart, disk->filesSize);
-                        }
+    _indexFile(disk, id);
 
-                        return true;
-                    }
-                    break;
+    return changed;
+}
 
-                case $ATTRIBUTE_LIST:
-                case $DATA:
-                case $BITMAP:
-                case $STANDARD_INFORMATION:         // 0x10,
-                case $OBJECT_ID:                    // 0x40,
-                case $SECURITY_DESCRIPTOR:          // 0x50,
-                case $VOLUME_NAME:                  // 0x60,
-                case $VOLUME_INFORMATION:           // 0x70,
-                case $INDEX_ROOT:                   // 0x90,
-                case $INDEX_ALLOCATION:             // 0xA0,
-                case $SYMBOLIC_LINK:                // 0xC0,
-                case $EA_INFORMATION:               // 0xD0,
-                case $EA:                           // 0xE0,
-                case $FIRST_USER_DEFINED_ATTRIBUTE: // 0x100
-                    break;
+// keep the extension index in step with a changed name, the lists stay sorted
+void NTFSDirectorySystem::_unindexFile(DiskHandle *disk, uint32_t id, FileEntry const &entry)
+{
+    if (entry.nameLength == 0 || (entry.flags & IS_DIRECTORY))
+    {
+        return;
+    }
 
-                default:
-                    break;
-            }
+    uint32_t slot = disk->extensions.findFileName(disk->name(entry), entry.nameLength);
+    if (slot == ExtensionTable::NOT_FOUND)
+    {
+        return;
+    }
 
-            ptr += residentAttribute->length;
-        }
+    auto &ids = disk->extensionFiles[slot];
+    auto found = std::lower_bound(ids.begin(), ids.end(), id);
+    if (found != ids.end() && *found == id)
+    {
+        ids.erase(size_t(found - ids.begin()));
     }
-    return false;
 }
 
-bool NTFSDirectorySystem::_reparseDisk(DiskHandle *disk)
+void NTFSDirectorySystem::_indexFile(DiskHandle *disk, uint32_t id)
 {
-    if (disk)
+    FileEntry const &entry = disk->files[id];
+    if (entry.nameLength == 0 || (entry.flags & IS_DIRECTORY))
     {
-        if (disk->type == eNTFS_DISK)
-        {
-            if (disk->NTFS.mft)
-            {
-                delete disk->NTFS.mft;
-            }
-            disk->NTFS.mft = nullptr;
-
-            /*if (disk->NTFS.bitmap)
-            {
-                delete disk->NTFS.bitmap;
-            }
-            disk->NTFS.bitmap = nullptr;
-            */
-        }
+        return;
+    }
 
-        disk->nameInfo.clear();
-        disk->filesSize = 0;
-        disk->realFiles = 0;
-        disk->fileInfo.clear();
+    uint32_t slot = disk->extensions.addFileName(disk->name(entry), entry.nameLength);
+    if (slot == disk->extensionFiles.size())
+    {
+        disk->extensionFiles.emplace_back();
+    }
 
-        if (_loadMFT(disk, false) != 0)
-        {
-            _parseMFT(disk);
-        }
-        return true;
+    auto &ids = disk->extensionFiles[slot];
+    auto found = std::lower_bound(ids.begin(), ids.end(), id);
+    if (found == ids.end() || *found != id)
+    {
+        ids.insert(size_t(found - ids.begin()), id);
     }
-    return false;
 }
 
-static int wcsnrcmp(const wchar_t *first, const wchar_t *last, size_t count)
+// sorted and without repeats; an id that was added or removed is not also reported modified
+void NTFSDirectorySystem::_finishChanges(DiskHandle *disk)
 {
-    if (!count)
-        return (0);
+    RecordChanges &changes = disk->changes;
 
-    while (--count && *first == *last)
+    for (auto *ids : {&changes.added, &changes.removed, &changes.modified})
     {
-        first--;
-        last--;
+        std::sort(ids->begin(), ids->end());
+        ids->erase(std::unique(ids->begin(), ids->end()), ids->end());
     }
 
-    return ((int)(*first - *last));
+    auto listed = [](std::vector<uint32_t> const &ids, uint32_t id) {
+        return std::binary_search(ids.begin(), ids.end(), id);
+    };
+
+    changes.modified.erase(std::remove_if(changes.modified.begin(), changes.modified.end(),
+                                          [&](uint32_t id) {
+                                              return listed(changes.added, id) || listed(changes.removed, id);
+                                          }),
+                           changes.modified.end());
 }
 
-// Prepares the search pattern struct
-SearchPattern *NTFSDirectorySystem::_startSearch(wchar_t *string, size_t len)
+// Reads the MFT again but only extracts the records whose LSN or sequence number differ
+// from the last scan, names and cached paths of the others are kept as they are.
+// Needs the stamps of a full scan made with incremental rescans enabled.
+
+bool NTFSDirectorySystem::_rescanDisk(DiskHandle *disk)
 {
-    wchar_t *res;
-    if (len > 1)
+    if (!_incrementalRescan || disk->type != eNTFS_DISK || disk->filesSize == 0 ||
+        disk->stamps.size() < disk->filesSize)
     {
-        SearchPattern *ptr;
-        ptr = new SearchPattern;
-        memset(ptr, 0, sizeof(SearchPattern));
-        ptr->mode = 0;
-        if (string[len - 1] == L'*')
-        {
-            ptr->mode += 2;
-            string[len - 1] = 0;
-            len--;
-        }
-        if (string[0] == L'*')
-        {
-            ptr->mode += 1;
-            string++;
-            len--;
-        }
+        return false;
+    }
 
-        ptr->string = string;
-        ptr->len = len;
-        ptr->totallen = ptr->len;
-        if (ptr->mode == 0)
-        {
-            res = wcschr(string, L'*');
-            if (res != nullptr)
-            {
-                ptr->mode = 42;
-                *res = L'\0';
-                ptr->len = res - string;
-                ptr->extra = &res[1];
-                ptr->extralen = len - ptr->len - 1;
-                ptr->totallen = ptr->len + ptr->extralen;
-            }
-        }
-        return ptr;
+    if (_loadMFT(disk, false) == 0)
+    {
+        return false;
     }
-    return nullptr;
+
+    _parseMFT(disk, true);
+    return true;
 }
 
-// does the actual search
-bool NTFSDirectorySystem::_searchString(SearchPattern *pattern, wchar_t *string, size_t len)
+// Runs on the parser threads. Each record is in one range only, so it is replaced by one
+// context at most and its entry and stamp are not shared.
+
+bool NTFSDirectorySystem::_recordChanged(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file,
+                                         uint32_t id)
 {
-    if (pattern->totallen > len)
+    RecordStamp const &stamp = disk->stamps[id];
+
+    if (stamp.lsn == uint64_t(file->Lsn.QuadPart) && stamp.sequenceNumber == file->SequenceNumber)
     {
         return false;
     }
 
-    switch (pattern->mode)
+    ReplacedRecord replaced;
+    replaced.id = id;
+    replaced.reused = stamp.sequenceNumber != file->SequenceNumber;
+    replaced.previous = disk->files[id];
+    context->replaced.push_back(replaced);
+
+    // a different file now, nothing of the old entry applies
+    if (replaced.reused)
+    {
+        disk->files[id] = FileEntry();
+    }
+
+    return true;
+}
+
+void NTFSDirectorySystem::_applyRescan(DiskHandle *disk, std::vector<ParseContext> &contexts)
+{
+    RecordChanges &changes = disk->changes;
+    changes.clear();
+
+    bool directoriesChanged = false;
+
+    for (auto &context : contexts)
     {
-        case 0:
-            if (wcscmp(string, pattern->string) == 0)
+        for (auto const &replaced : context.replaced)
+        {
+            FileEntry const &previous = replaced.previous;
+            FileEntry const &entry = disk->files[replaced.id];
+
+            bool wasInUse = (previous.flags & IN_USE) != 0;
+            bool inUse = (entry.flags & IN_USE) != 0;
+
+            if (replaced.reused || wasInUse != inUse)
             {
-                return true;
+                if (wasInUse)
+                {
+                    changes.removed.push_back(replaced.id);
+                }
+                if (inUse)
+                {
+                    changes.added.push_back(replaced.id);
+                }
             }
-            break;
-
-        case 1:
-            if (wcsnrcmp(string + len, pattern->string + pattern->len, pattern->len + 1) == 0)
+            else if (inUse)
             {
-                return true;
+                changes.modified.push_back(replaced.id);
             }
-            break;
 
-        case 2:
-            if (wcsncmp(string, pattern->string, pattern->len) == 0)
+            bool moved = previous.parent != entry.parent || previous.flags != entry.flags ||
+                         previous.nameLength != entry.nameLength ||
+                         (entry.nameLength != 0 &&
+                          memcmp(disk->name(previous), disk->name(entry), entry.nameLength * sizeof(wchar_t)) != 0);
+
+            if (moved && ((previous.flags | entry.flags) & IS_DIRECTORY))
             {
-                return true;
+                directoriesChanged = true;
             }
-            break;
 
-        case 3:
-            if (wcsstr(string, pattern->string) != nullptr)
+            disk->realFiles += (entry.nameLength != 0 ? 1 : 0) - (previous.nameLength != 0 ? 1 : 0);
+
+            if (moved)
             {
-                return true;
+                _unindexFile(disk, replaced.id, previous);
+                _indexFile(disk, replaced.id);
             }
-            break;
+        }
+        context.replaced.clear();
+    }
 
-        case 42:
-            if (wcsnrcmp(string + len, pattern->extra + pattern->extralen, pattern->extralen + 1) == 0)
+    // records freed since the last scan were not read at all
+    if (!disk->scanDeleted)
+    {
+        for (uint32_t id = 0; id < disk->files.size(); id++)
+        {
+            FileEntry &entry = disk->files[id];
+            if ((entry.flags & IN_USE) && !_recordInUse(disk, id))
             {
-                if (wcsncmp(string, pattern->string, pattern->len) == 0)
-                {
-                    return true;
-                }
+                changes.removed.push_back(id);
+                directoriesChanged |= (entry.flags & IS_DIRECTORY) != 0;
+                disk->realFiles -= entry.nameLength != 0 ? 1 : 0;
+
+                _unindexFile(disk, id, entry);
+                entry = FileEntry();
+                disk->stamps[id] = RecordStamp();
             }
-            break;
+        }
     }
 
-    return false;
-}
+    if (directoriesChanged)
+    {
+        disk->pathCache.clear();
+        disk->excludedVersion = 0;
+    }
 
-void NTFSDirectorySystem::_endSearch(SearchPattern *pattern)
-{
-    delete pattern;
+    _finishChanges(disk);
 }
 
 bool NTFSDirectorySystem::_fixFileRecord(FILE_RECORD_SEGMENT_HEADER *file)
@@ -1292,12 +3315,89 @@ bool NTFSDirectorySystem::_fixFileRecord(FILE_RECORD_SEGMENT_HEADER *file)
     return true;
 }
 
-void NTFSDirectorySystem::_saveFileName(std::wstring const &wPath, std::wstring const &wFileName)
+// path and name are encoded straight into one reused buffer
+void NTFSDirectorySystem::_saveFileName(std::wstring const &wPath, wchar_t const *fileName, uint32_t length)
+{
+    _filePath.clear();
+    appendUtf8(_filePath, wPath.data(), wPath.length());
+    appendUtf8(_filePath, fileName, length);
+
+    signalFileName(_filePath);
+}
+
+void NTFSDirectorySystem::setResultSink(FileResultSink *sink, uint32_t batchSize)
 {
-    String path = fromStdWString(wPath);
-    String fileName = fromStdWString(wFileName);
+    _flushResults();
+
+    _resultSink = sink;
+    _resultBatchSize = std::max(batchSize, 1u);
+    _results.reserve(_resultBatchSize);
+}
+
+// Without a sink every hit still goes to signalFileName as a UTF-8 path. With one, hits
+// are only recorded and handed over a batch at a time.
+
+void NTFSDirectorySystem::_addResult(DiskHandle *disk, uint32_t id)
+{
+    FileEntry const &entry = disk->files[id];
+
+    if (_resultSink == nullptr)
+    {
+        _saveFileName(_path(disk, id), disk->name(entry), entry.nameLength);
+        return;
+    }
+
+    FileResult result;
+    result.drive = disk->drive;
+    result.id = id;
+    result.directory = entry.parent;
+    result.name = disk->name(entry);
+    result.nameLength = entry.nameLength;
+    result.flags = entry.flags;
+
+    _results.push_back(result);
+
+    if (_results.size() >= _resultBatchSize)
+    {
+        _flushResults();
+    }
+}
+
+void NTFSDirectorySystem::_flushResults()
+{
+    if (_resultSink != nullptr && !_results.empty())
+    {
+        _resultSink->results(*this, _results.data(), _results.size());
+    }
+    _results.clear();
+}
+
+std::wstring const &NTFSDirectorySystem::directoryPath(FileResult const &result)
+{
+    return _directoryPath(disks[result.drive], result.directory);
+}
+
+String NTFSDirectorySystem::filePath(FileResult const &result)
+{
+    String path;
+    appendUtf8(path, directoryPath(result).data(), directoryPath(result).length());
+    appendUtf8(path, result.name, result.nameLength);
+
+    return path;
+}
+
+size_t NTFSDirectorySystem::filePath(FileResult const &result, char *buffer, size_t size)
+{
+    std::wstring const &directory = directoryPath(result);
+
+    size_t needed = utf8Capacity(directory.length() + result.nameLength);
+    if (size < needed)
+    {
+        return 0;
+    }
 
-    String filePath = path + fileName;
+    size_t used = encodeUtf8(directory.data(), directory.length(), buffer);
+    used += encodeUtf8(result.name, result.nameLength, buffer + used);
 
-    signalFileName(filePath);
+    return used;
 }
@@ -10,8 +10,10 @@
 
 #include <algorithm>
 #include <functional>
+#include <map>
 #include <malloc.h>
 #include <memory.h>
+#include <memory>
 #include <set>
 #include <vector>
 #include <unordered_set>
@@ -23,19 +25,10 @@
 
 #include "ntfs_struct.h"
 
-struct SearchPattern;
 class DiskHandle;
-struct LinkItem;
-
-struct SearchPattern
-{
-    int mode;
-    wchar_t *string;
-    size_t len;
-    wchar_t *extra;
-    size_t extralen;
-    size_t totallen;
-};
+class GlobPattern;
+class RegexPattern;
+struct ParseContext;
 
 #define DISK_A (1 << 0)
 #define DISK_B (1 << 1)
@@ -75,20 +68,114 @@ typedef std::string String;
 void signalFileName(String const &filePath);
 void signalDirectoryProgress(size_t n, size_t total, String const &text);
 
+class NTFSDirectorySystem;
+
+// A search hit. name points into the disk's name storage, zero terminated, and stays
+// valid until the disk is reparsed or closed.
+struct FileResult
+{
+    int drive;
+    uint32_t id;        // MFT record number
+    uint32_t directory; // record number of the folder holding it
+    wchar_t const *name;
+    uint16_t nameLength;
+    uint16_t flags; // IN_USE, IS_DIRECTORY
+};
+
+// Receives search hits in batches instead of one signalFileName call per file.
+// The array is reused for the next batch. Paths and UTF-8 names are only built when
+// asked for through NTFSDirectorySystem::directoryPath and filePath.
+class FileResultSink
+{
+public:
+    virtual ~FileResultSink()
+    {
+    }
+
+    virtual void results(NTFSDirectorySystem &ntfs, FileResult const *results, size_t count) = 0;
+};
+
 class NTFSDirectorySystem
 {
 
 public:
     NTFSDirectorySystem();
 
-    bool readDisks(uint32_t driveMask, bool reload = false);
+    // deleted also parses the records the $MFT bitmap marks as free, needed to find deleted files
+    bool readDisks(uint32_t driveMask, bool reload = false, bool deleted = false);
+
+    // scan a raw NTFS image file or block device into slot drive (0-31), searched with (1 << drive)
+    bool readImage(int drive, String const &imagePath, bool deleted = false);
+
+    // save the parsed state of a drive slot, to start from later with loadSnapshot
+    bool saveSnapshot(int drive, String const &file);
+
+    // opens drive slot like readDisks, or the image like readImage when imagePath is given,
+    // and loads the snapshot if it matches the volume serial number and $MFT size;
+    // otherwise the volume is scanned as usual
+    bool loadSnapshot(int drive, String const &file, String const &imagePath = String());
+
+    // number of MFT reads kept queued on the volume while scanning, default 4
+    void setReadsInFlight(uint32_t count);
+
+    // threads parsing MFT records, 0 for one per core, default 1
+    void setParserThreads(uint32_t count);
+
+    // also keep sizes, times and attributes of every record, off by default
+    void setCollectFileDetails(bool collect);
+
+    // keep the LSN and sequence number of every record, so that a reload without a usable
+    // change journal only extracts the records written since the last scan; off by default
+    void setIncrementalRescan(bool incremental);
+
+    // readDisks scans all selected volumes at once instead of one after another, each on
+    // its own reader and parser threads; off by default
+    void setConcurrentScan(bool concurrent);
+
+    // keep a trigram index of the names for searchForFilesViaSubstring, built after each
+    // load; off by default
+    void setTrigramIndex(bool enabled);
+
+    // bytes held by the trigram indexes of the selected drives
+    size_t trigramIndexMemory(int driveMask) const;
+
+    // records added, removed and modified by the last reload of a drive slot
+    RecordChanges const *changes(int drive) const;
 
-    // int searchForFilesViaRegularExpression(int driveMask, QString const &filename, bool deleted);
     int searchForFilesViaExtensions(int driveMask, std::unordered_set<String> const &extensions, bool deleted = false);
 
+    // files and directories whose name matches a wildcard pattern: any number of '*', '?'
+    // and [a-z] / [!a-z] classes; case insensitive unless the system is case sensitive
+    int searchForFilesViaGlob(int driveMask, String const &pattern, bool deleted = false);
+
+    // files and directories whose name contains a match of a regular expression, see Regex.h
+    // for the syntax; compiled patterns are kept for the next searches; -1 if it does not compile
+    int searchForFilesViaRegularExpression(int driveMask, String const &expression, bool deleted = false);
+
+    // files and directories whose name contains text, case insensitive unless the system is
+    // case sensitive; answered from the trigram index when there is one and text has at
+    // least three characters
+    int searchForFilesViaSubstring(int driveMask, String const &text, bool deleted = false);
+
+    // lower case extension -> number of files with it, "" for names without one
+    std::map<String, uint32_t> extensionCounts(int driveMask, bool deleted = false);
+
     int gatherAllFiles(int driveMask, bool deleted);
     int gatherAllDirectories(int driveMask, bool deleted);
 
+    // searches report to sink instead of signalFileName, nullptr restores signalFileName
+    void setResultSink(FileResultSink *sink, uint32_t batchSize = 4096);
+
+    // folder of a result with a trailing backslash, cached per disk
+    std::wstring const &directoryPath(FileResult const &result);
+
+    // full UTF-8 path of a result, as signalFileName would get it
+    String filePath(FileResult const &result);
+
+    // same, written into buffer without a terminating zero; returns the length, or 0 if
+    // size is below utf8Capacity() of the path
+    size_t filePath(FileResult const &result, char *buffer, size_t size);
+
     void addToBlackList(String const &directory);
     void clearBlackList();
     void closeDisks();
@@ -96,59 +183,124 @@ public:
     // signals:
 
 private:
-    int _searchForFilesViaRegularExpression(DiskHandle *disk, TCHAR *filename, bool deleted, SearchPattern *pat);
+    int _searchForFilesViaGlob(DiskHandle *disk, GlobPattern const &glob, bool deleted);
+    int _searchForFilesViaRegularExpression(DiskHandle *disk, RegexPattern &regex, bool deleted);
+    RegexPattern *_compileRegularExpression(std::wstring const &expression, DiskHandle *disk);
+    int _searchForFilesViaSubstring(DiskHandle *disk, std::wstring const &text, bool deleted);
+    bool _matchSubstring(DiskHandle *disk, uint32_t id, std::wstring const &text, bool deleted);
     int _searchForFilesViaExtensions(DiskHandle *disk, std::unordered_set<std::wstring> const &extensions,
                                      bool deleted);
     int _gatherAllFiles(DiskHandle *disk, bool deleted);
     int _gatherAllDirectories(DiskHandle *disk, bool deleted);
 
-    SearchPattern *_startSearch(wchar_t *string, size_t len);
-    bool _searchString(SearchPattern *pattern, wchar_t *string, size_t len);
-    void _endSearch(SearchPattern *pattern);
-
     bool _loadSearchInfo(DiskHandle *disk);
+    bool _loadDisks(std::vector<DiskHandle *> const &load);
+    void _signalProgress(DiskHandle *disk, size_t n, size_t total, String const &text);
+    bool _readSnapshot(DiskHandle *disk, String const &file);
+    void _dropDiskIndex(DiskHandle *disk);
+    void _updateNameIndexes(DiskHandle *disk);
+    void _updateFoldedNames(DiskHandle *disk);
+    void _updateTrigrams(DiskHandle *disk);
+    void _readUpCase(DiskHandle *disk);
 
-    void _addToFixList(int entry, int data);
-    void _createFixList();
-    void _processFixList(DiskHandle *disk);
+    void _applyFixups(DiskHandle *disk, std::vector<ParseContext> &contexts);
 
     DiskHandle *_openDisk(wchar_t DosDevice);
-    DiskHandle *_openDisk(wchar_t const *disk);
+    DiskHandle *_openDisk(VolumeSource *source);
     bool _closeDisk(DiskHandle *disk);
     uint64_t _loadMFT(DiskHandle *disk, bool complete);
     NonresidentAttribute *_findAttribute(FILE_RECORD_SEGMENT_HEADER *file, int type);
-    void _parseMFT(DiskHandle *disk);
-    uint32_t _readMFTParse(DiskHandle *disk, NonresidentAttribute *attr, uint64_t vcn, uint32_t count, void *buffer,
-                           FetchProcedure fetch);
+    void _parseMFT(DiskHandle *disk, bool rescan = false);
+    uint32_t _readMFTParse(DiskHandle *disk, NonresidentAttribute *attr, uint64_t vcn, uint32_t count,
+                           FetchProcedure fetch, bool rescan = false);
+
+    void _skipUnusedRecords(DiskHandle *disk, std::vector<MFTChunk> &chunks);
+    bool _recordInUse(DiskHandle *disk, uint32_t id);
+    bool _readAttribute(DiskHandle *disk, Attribute *attribute, std::vector<uint8_t> &data);
 
     uint32_t _runLength(uint8_t *run);
     int64_t _runLCN(uint8_t *run);
     uint64_t _runCount(uint8_t *run);
     bool _findRun(NonresidentAttribute *attr, uint64_t vcn, uint64_t *lcn, uint64_t *count);
 
-    uint32_t _readMFTLCN(DiskHandle *disk, uint64_t lcn, uint32_t count, PVOID buffer, FetchProcedure fetch);
+    void _processBuffer(DiskHandle *disk, ParseContext *context, uint8_t *buffer, uint32_t size, uint32_t firstRecord,
+                        FetchProcedure fetch);
+    std::wstring const &_path(DiskHandle *disk, uint32_t id);
+    std::wstring const &_directoryPath(DiskHandle *disk, uint32_t directory);
 
-    void _processBuffer(DiskHandle *disk, uint8_t *buffer, uint32_t size, FetchProcedure fetch);
-    std::wstring _path(DiskHandle *disk, uint32_t id);
-
-    bool _fetchSearchInfo(DiskHandle *disk, FILE_RECORD_SEGMENT_HEADER *file, LongFileInfo *longFileInfo);
+    bool _fetchSearchInfo(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file, uint32_t id);
+    void _fetchDetails(DiskHandle *disk, ResidentAttribute *attribute, LongFileInfo *details);
+    void _fetchExtension(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file, uint32_t id);
     bool _fixFileRecord(FILE_RECORD_SEGMENT_HEADER *file);
     bool _reparseDisk(DiskHandle *disk);
 
-    void _saveFileName(std::wstring const &path, std::wstring const &fileName);
-
-    std::wstring _extension(std::wstring const &fileName);
-
-    bool _startsWith(std::wstring const &name, std::wstring const &start);
-    wchar_t *_allocateString(DiskHandle *disk, wchar_t *fileName, int size);
+    bool _readAttributeRange(DiskHandle *disk, NonresidentAttribute *attr, uint64_t offset, uint32_t size,
+                             uint8_t *buffer);
+    bool _readRecord(DiskHandle *disk, uint32_t id, std::vector<uint8_t> &record);
+    Attribute *_findNamedAttribute(FILE_RECORD_SEGMENT_HEADER *file, uint32_t recordSize, int type,
+                                   wchar_t const *name);
+    uint32_t _findJournalRecord(DiskHandle *disk);
+    bool _readJournalState(DiskHandle *disk, UsnJournal &journal, std::vector<uint8_t> &record);
+    bool _replayJournal(DiskHandle *disk);
+    bool _applyUsnRecord(DiskHandle *disk, NameArena::Cursor *names, uint32_t id, uint32_t parent,
+                         wchar_t const *name, uint32_t length, uint32_t reason, uint32_t attributes);
+    void _indexFile(DiskHandle *disk, uint32_t id);
+    void _unindexFile(DiskHandle *disk, uint32_t id, FileEntry const &entry);
+    void _finishChanges(DiskHandle *disk);
+
+    bool _rescanDisk(DiskHandle *disk);
+    bool _recordChanged(DiskHandle *disk, ParseContext *context, FILE_RECORD_SEGMENT_HEADER *file, uint32_t id);
+    void _applyRescan(DiskHandle *disk, std::vector<ParseContext> &contexts);
+
+    void _saveFileName(std::wstring const &path, wchar_t const *fileName, uint32_t length);
+    void _addResult(DiskHandle *disk, uint32_t id);
+    void _flushResults();
+
+    void _indexExtension(ParseContext *context, wchar_t const *name, uint32_t length, uint32_t id);
+
+    void _resolveBlackList(DiskHandle *disk);
+
+    // true if the folder of record id is at or below a blacklisted directory
+    bool _excluded(DiskHandle *disk, uint32_t id)
+    {
+        // records appended since the bitset was built are past its end, and not excluded
+        uint32_t parent = disk->files[id].parent;
+        return (parent >> 6) < disk->excluded.size() && ((disk->excluded[parent >> 6] >> (parent & 63)) & 1) != 0;
+    }
+    uint32_t _allocateString(ParseContext *context, wchar_t *fileName, int size);
+
+    // $UpCase the search patterns are folded with, nullptr when names are compared as they are
+    wchar_t const *_searchFold(DiskHandle *disk) const
+    {
+        return _caseSensitive || disk->foldedNames.empty() ? nullptr : disk->upcase.data();
+    }
+
+    // the name searches compare
+    wchar_t const *_searchName(DiskHandle *disk, FileEntry const &entry) const
+    {
+        return _searchFold(disk) != nullptr ? disk->foldedName(entry) : disk->name(entry);
+    }
 
 private:
-    LinkItem *fixlist = nullptr;
-    LinkItem *curfix = nullptr;
-
     bool _caseSensitive = false;
 
+    uint32_t _readsInFlight = 4;
+    uint32_t _parserThreads = 1;
+    bool _collectFileDetails = false;
+    bool _incrementalRescan = false;
+    bool _concurrentScan = false;
+    bool _trigramIndex = false;
+
     DiskHandle *disks[32];
 
+    // most recently used first, with the hash of the $UpCase they were folded with
+    std::vector<std::pair<uint64_t, std::shared_ptr<RegexPattern>>> _regexCache;
+
     std::vector<std::wstring> _blackList;
+    uint32_t _blackListVersion = 1;
+
+    FileResultSink *_resultSink = nullptr;
+    uint32_t _resultBatchSize = 4096;
+    std::vector<FileResult> _results;
+    String _filePath;
 };
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 64K characters per chunk, a name never crosses a chunk boundary
+#define NAME_CHUNK_SHIFT 16
+#define NAME_CHUNK_SIZE (1 << NAME_CHUNK_SHIFT)
+
+// Bump allocator for the file names of one disk.
+// Names are packed into large chunks that are freed all at once, instead of one heap
+// block and one shared_ptr control block per name. Each parser thread appends through its
+// own Cursor, which takes whole chunks from the arena, so only a chunk switch takes the lock.
+//
+// A name is referred to by a 32 bit offset, chunk index in the high bits, so the
+// record table holds no pointers. Chunks can also be the name section of a mapped
+// snapshot, names added later go to new chunks after them.
+
+class NameArena
+{
+public:
+    class Cursor
+    {
+    public:
+        Cursor()
+        {
+        }
+
+        explicit Cursor(NameArena *arena) : _arena(arena)
+        {
+        }
+
+        // copies length characters and adds the terminating zero, returns the offset
+        uint32_t allocate(wchar_t const *name, uint32_t length)
+        {
+            if (_chunk == nullptr || _used + length + 1 > NAME_CHUNK_SIZE)
+            {
+                _chunk = _arena->_newChunk(&_chunkIndex);
+                _used = 0;
+            }
+
+            uint32_t offset = (_chunkIndex << NAME_CHUNK_SHIFT) | _used;
+
+            wchar_t *mem = _chunk + _used;
+            memcpy(mem, name, length * sizeof(wchar_t));
+            mem[length] = L'\0';
+            _used += length + 1;
+
+            return offset;
+        }
+
+    private:
+        NameArena *_arena = nullptr;
+        wchar_t *_chunk = nullptr;
+        uint32_t _chunkIndex = 0;
+        uint32_t _used = 0;
+    };
+
+    wchar_t const *at(uint32_t offset) const
+    {
+        return _chunks[offset >> NAME_CHUNK_SHIFT] + (offset & (NAME_CHUNK_SIZE - 1));
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _chunks.clear();
+        _owned.clear();
+    }
+
+    // heap used by the arena, mapped chunks are not counted
+    size_t memoryUsed() const
+    {
+        return _owned.size() * NAME_CHUNK_SIZE * sizeof(wchar_t);
+    }
+
+    uint32_t chunkCount() const
+    {
+        return uint32_t(_chunks.size());
+    }
+
+    wchar_t const *chunk(uint32_t index) const
+    {
+        return _chunks[index];
+    }
+
+    // use count chunks stored back to back at names, which must outlive the arena's use
+    void mapChunks(wchar_t *names, uint32_t count)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            _chunks.push_back(names + size_t(i) * NAME_CHUNK_SIZE);
+        }
+    }
+
+private:
+    wchar_t *_newChunk(uint32_t *index)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        *index = uint32_t(_chunks.size());
+        // zeroed so that the unused tail of a chunk can be saved as is
+        _owned.emplace_back(new wchar_t[NAME_CHUNK_SIZE]());
+        _chunks.push_back(_owned.back().get());
+        return _chunks.back();
+    }
+
+    std::mutex _mutex;
+    std::vector<wchar_t *> _chunks;
+    std::vector<std::unique_ptr<wchar_t[]>> _owned;
+};
+
+// The names of an arena mapped through a volume's $UpCase table, at the same offsets, so
+// case insensitive searches compare them as they are and fold nothing per name. Like the
+// arena, the first chunks can be a section of a mapped snapshot.
+
+class FoldedNames
+{
+public:
+    // folds the chunks added to names since the last call
+    void update(NameArena const &names, wchar_t const *upcase)
+    {
+        for (uint32_t index = uint32_t(_chunks.size()); index < names.chunkCount(); index++)
+        {
+            _owned.emplace_back(new wchar_t[NAME_CHUNK_SIZE]);
+            fold(names.chunk(index), upcase, _owned.back().get());
+            _chunks.push_back(_owned.back().get());
+        }
+    }
+
+    // a whole chunk, the unused tail included
+    static void fold(wchar_t const *chunk, wchar_t const *upcase, wchar_t *folded)
+    {
+        for (uint32_t i = 0; i < NAME_CHUNK_SIZE; i++)
+        {
+            folded[i] = upcase[uint16_t(chunk[i])];
+        }
+    }
+
+    // use count folded chunks stored back to back at names, see NameArena::mapChunks
+    void mapChunks(wchar_t *names, uint32_t count)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            _chunks.push_back(names + size_t(i) * NAME_CHUNK_SIZE);
+        }
+    }
+
+    // folds one name again, for a name written into a chunk that was folded before
+    void refold(NameArena const &names, wchar_t const *upcase, uint32_t offset, uint32_t length)
+    {
+        wchar_t const *name = names.at(offset);
+        wchar_t *folded = _chunks[offset >> NAME_CHUNK_SHIFT] + (offset & (NAME_CHUNK_SIZE - 1));
+
+        for (uint32_t i = 0; i < length; i++)
+        {
+            folded[i] = upcase[uint16_t(name[i])];
+        }
+    }
+
+    wchar_t const *at(uint32_t offset) const
+    {
+        return _chunks[offset >> NAME_CHUNK_SHIFT] + (offset & (NAME_CHUNK_SIZE - 1));
+    }
+
+    bool empty() const
+    {
+        return _chunks.empty();
+    }
+
+    uint32_t chunkCount() const
+    {
+        return uint32_t(_chunks.size());
+    }
+
+    wchar_t const *chunk(uint32_t index) const
+    {
+        return _chunks[index];
+    }
+
+    void clear()
+    {
+        _chunks.clear();
+        _owned.clear();
+    }
+
+    // heap used, mapped chunks are not counted
+    size_t memoryUsed() const
+    {
+        return _owned.size() * NAME_CHUNK_SIZE * sizeof(wchar_t);
+    }
+
+private:
+    std::vector<wchar_t *> _chunks;
+    std::vector<std::unique_ptr<wchar_t[]>> _owned;
+};
@@ -0,0 +1,389 @@
+#include "NameKernels.h"
+
+#include <string.h>
+#include <wchar.h>
+
+#include "ExtensionTable.h"
+
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)) && WCHAR_MAX <= 0xffff
+#define NAME_KERNELS_X86
+#endif
+
+#ifdef NAME_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#if defined(__x86_64__)
+#define TARGET_SSE2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#endif
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// scalar, also the tails of the vector loops
+
+static size_t findLastDotScalar(wchar_t const *name, size_t length)
+{
+    for (size_t i = length; i > 0; i--)
+    {
+        if (name[i - 1] == L'.')
+        {
+            return i - 1;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+static bool equalFoldedScalar(wchar_t const *folded, wchar_t const *name, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (folded[i] != foldExtensionChar(name[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t findFrom(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength, size_t start)
+{
+    for (size_t i = start; i + textLength <= length; i++)
+    {
+        if (name[i] == text[0] && memcmp(name + i + 1, text + 1, (textLength - 1) * sizeof(wchar_t)) == 0)
+        {
+            return i;
+        }
+    }
+    return NAME_NOT_FOUND;
+}
+
+static size_t findScalar(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength)
+{
+    if (textLength == 0)
+    {
+        return 0;
+    }
+    return findFrom(name, length, text, textLength, 0);
+}
+
+#ifdef NAME_KERNELS_X86
+
+// movemask gives two bits per 16 bit lane, the lane of bit b is b / 2
+
+#ifdef _MSC_VER
+static inline uint32_t lowestBit(uint32_t mask)
+{
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+}
+
+static inline uint32_t highestBit(uint32_t mask)
+{
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return index;
+}
+#else
+static inline uint32_t lowestBit(uint32_t mask)
+{
+    return uint32_t(__builtin_ctz(mask));
+}
+
+static inline uint32_t highestBit(uint32_t mask)
+{
+    return uint32_t(31 - __builtin_clz(mask));
+}
+#endif
+
+// movemask bits of the first lanes of a block
+static inline uint32_t laneBits(size_t lanes)
+{
+    return lanes >= 16 ? 0xffffffff : (1u << (2 * lanes)) - 1;
+}
+
+// A load that stays inside one page cannot fault when that page holds part of the name,
+// so the last, partial block of a name is loaded whole and the lanes past it ignored.
+static inline bool inOnePage(void const *p, size_t bytes)
+{
+    return (uintptr_t(p) & 4095) <= 4096 - bytes;
+}
+
+// SSE2, 8 characters at a time
+
+TARGET_SSE2 static size_t findLastDotSSE2(wchar_t const *name, size_t length)
+{
+    __m128i dot = _mm_set1_epi16(L'.');
+    size_t i = length;
+
+    for (; i >= 8; i -= 8)
+    {
+        __m128i chars = _mm_loadu_si128((__m128i const *)(name + i - 8));
+        uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi16(chars, dot)));
+        if (mask != 0)
+        {
+            return i - 8 + highestBit(mask) / 2;
+        }
+    }
+
+    if (i == 0 || !inOnePage(name, 16))
+    {
+        return findLastDotScalar(name, i);
+    }
+
+    uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((__m128i const *)name), dot)));
+    mask &= laneBits(i);
+    return mask != 0 ? highestBit(mask) / 2 : NAME_NOT_FOUND;
+}
+
+// movemask bits of the lanes where name, folded like foldExtensionChar, equals folded;
+// lanes that are not ASCII are left to the caller in *other
+TARGET_SSE2 static inline uint32_t equalLanesSSE2(wchar_t const *folded, wchar_t const *name, uint32_t *other)
+{
+    __m128i chars = _mm_loadu_si128((__m128i const *)name);
+    __m128i keys = _mm_loadu_si128((__m128i const *)folded);
+
+    *other = uint32_t(~_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chars, _mm_set1_epi16(short(0xff80))),
+                                                         _mm_setzero_si128()))) & 0xffff;
+
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(chars, _mm_set1_epi16(L'A' - 1)),
+                                  _mm_cmplt_epi16(chars, _mm_set1_epi16(L'Z' + 1)));
+    __m128i lowered = _mm_add_epi16(chars, _mm_and_si128(upper, _mm_set1_epi16(L'a' - L'A')));
+    return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi16(lowered, keys)));
+}
+
+TARGET_SSE2 static bool equalFoldedSSE2(wchar_t const *folded, wchar_t const *name, size_t length)
+{
+    size_t i = 0;
+    uint32_t other;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint32_t equal = equalLanesSSE2(folded + i, name + i, &other);
+        if (other != 0)
+        {
+            // other characters need towlower
+            if (!equalFoldedScalar(folded + i, name + i, 8))
+            {
+                return false;
+            }
+        }
+        else if (equal != 0xffff)
+        {
+            return false;
+        }
+    }
+
+    size_t rest = length - i;
+    if (rest == 0 || !inOnePage(name + i, 16) || !inOnePage(folded + i, 16))
+    {
+        return equalFoldedScalar(folded + i, name + i, rest);
+    }
+
+    uint32_t lanes = laneBits(rest);
+    uint32_t equal = equalLanesSSE2(folded + i, name + i, &other);
+    if ((other & lanes) != 0)
+    {
+        return equalFoldedScalar(folded + i, name + i, rest);
+    }
+    return (equal & lanes) == lanes;
+}
+
+// Candidates are the positions where both the first and the last character of text
+// match, only those are compared in full.
+
+TARGET_SSE2 static inline uint32_t candidatesSSE2(wchar_t const *name, size_t textLength, __m128i first, __m128i last)
+{
+    __m128i head = _mm_loadu_si128((__m128i const *)name);
+    __m128i tail = _mm_loadu_si128((__m128i const *)(name + textLength - 1));
+    return uint32_t(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(head, first), _mm_cmpeq_epi16(tail, last)))) &
+           0x5555;
+}
+
+static inline size_t verify(wchar_t const *name, size_t i, uint32_t mask, wchar_t const *text, size_t textLength)
+{
+    while (mask != 0)
+    {
+        size_t position = i + lowestBit(mask) / 2;
+        if (textLength <= 2 || memcmp(name + position + 1, text + 1, (textLength - 2) * sizeof(wchar_t)) == 0)
+        {
+            return position;
+        }
+        mask &= mask - 1;
+    }
+    return NAME_NOT_FOUND;
+}
+
+TARGET_SSE2 static size_t findSSE2(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength)
+{
+    if (textLength == 0)
+    {
+        return 0;
+    }
+    if (textLength > length)
+    {
+        return NAME_NOT_FOUND;
+    }
+
+    __m128i first = _mm_set1_epi16(short(text[0]));
+    __m128i last = _mm_set1_epi16(short(text[textLength - 1]));
+    size_t positions = length - textLength + 1;
+    size_t i = 0;
+
+    for (; i + 8 <= positions; i += 8)
+    {
+        size_t found = verify(name, i, candidatesSSE2(name + i, textLength, first, last), text, textLength);
+        if (found != NAME_NOT_FOUND)
+        {
+            return found;
+        }
+    }
+
+    size_t rest = positions - i;
+    if (rest == 0 || !inOnePage(name + i, 16) || !inOnePage(name + i + textLength - 1, 16))
+    {
+        return findFrom(name, length, text, textLength, i);
+    }
+    return verify(name, i, candidatesSSE2(name + i, textLength, first, last) & laneBits(rest), text, textLength);
+}
+
+// AVX2, 16 positions at a time, the rest of a name as for SSE2. Only the substring search
+// gains from it: names are mostly shorter than 16 characters to their last dot, and there
+// the wider loads lose to SSE2.
+
+TARGET_AVX2 static inline uint32_t candidatesAVX2(wchar_t const *name, size_t textLength, __m256i first, __m256i last)
+{
+    __m256i head = _mm256_loadu_si256((__m256i const *)name);
+    __m256i tail = _mm256_loadu_si256((__m256i const *)(name + textLength - 1));
+    return uint32_t(_mm256_movemask_epi8(
+               _mm256_and_si256(_mm256_cmpeq_epi16(head, first), _mm256_cmpeq_epi16(tail, last)))) &
+           0x55555555;
+}
+
+TARGET_AVX2 static size_t findAVX2(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength)
+{
+    if (textLength == 0)
+    {
+        return 0;
+    }
+    if (textLength > length)
+    {
+        return NAME_NOT_FOUND;
+    }
+
+    __m256i first = _mm256_set1_epi16(short(text[0]));
+    __m256i last = _mm256_set1_epi16(short(text[textLength - 1]));
+    size_t positions = length - textLength + 1;
+    size_t i = 0;
+
+    for (; i + 16 <= positions; i += 16)
+    {
+        size_t found = verify(name, i, candidatesAVX2(name + i, textLength, first, last), text, textLength);
+        if (found != NAME_NOT_FOUND)
+        {
+            return found;
+        }
+    }
+
+    size_t rest = positions - i;
+    if (rest == 0)
+    {
+        return NAME_NOT_FOUND;
+    }
+    if (!inOnePage(name + i, 32) || !inOnePage(name + i + textLength - 1, 32))
+    {
+        size_t found = findSSE2(name + i, length - i, text, textLength);
+        return found == NAME_NOT_FOUND ? found : i + found;
+    }
+    return verify(name, i, candidatesAVX2(name + i, textLength, first, last) & laneBits(rest), text, textLength);
+}
+
+// AVX2 also needs the OS to save the upper halves of the registers
+static bool supportsAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+
+    __cpuid(info, 1);
+    bool osSaves = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+    __cpuidex(info, 7, 0);
+    return osSaves && (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool supportsSSE2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+static NameKernels const kernels[] = {
+    {NAME_KERNELS_SCALAR, findLastDotScalar, equalFoldedScalar, findScalar},
+#ifdef NAME_KERNELS_X86
+    {NAME_KERNELS_SSE2, findLastDotSSE2, equalFoldedSSE2, findSSE2},
+    {NAME_KERNELS_AVX2, findLastDotSSE2, equalFoldedSSE2, findAVX2},
+#endif
+};
+
+static NameKernelLevel supportedLevel()
+{
+#ifdef NAME_KERNELS_X86
+    if (supportsAVX2())
+    {
+        return NAME_KERNELS_AVX2;
+    }
+    if (supportsSSE2())
+    {
+        return NAME_KERNELS_SSE2;
+    }
+#endif
+    return NAME_KERNELS_SCALAR;
+}
+
+NameKernels const &nameKernels(NameKernelLevel level)
+{
+    static NameKernelLevel const supported = supportedLevel();
+    return kernels[level < supported ? level : supported];
+}
+
+NameKernels const &nameKernels()
+{
+    static NameKernels const &best = nameKernels(NAME_KERNELS_AVX2);
+    return best;
+}
+
+char const *nameKernelLevelName(NameKernelLevel level)
+{
+    switch (level)
+    {
+        case NAME_KERNELS_SSE2:
+            return "SSE2";
+        case NAME_KERNELS_AVX2:
+            return "AVX2";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Loops over UTF-16 names, in a scalar version and vectorized ones for SSE2 and AVX2
+// (substring search only, the other loops keep SSE2 there).
+// The best version the CPU and OS support is picked once, on first use, from cpuid;
+// builds for other processors, or where wchar_t is not 16 bits, get the scalar one.
+//
+// The last, partial block of a name is loaded whole when the load stays in the page
+// the name is on, and the lanes past the name are masked off; a load that would cross
+// into the next page takes the scalar loop instead, so nothing past the name can fault.
+
+enum NameKernelLevel
+{
+    NAME_KERNELS_SCALAR,
+    NAME_KERNELS_SSE2,
+    NAME_KERNELS_AVX2
+};
+
+#define NAME_NOT_FOUND size_t(-1)
+
+struct NameKernels
+{
+    NameKernelLevel level;
+
+    // position of the last '.', NAME_NOT_FOUND if there is none
+    size_t (*findLastDot)(wchar_t const *name, size_t length);
+
+    // name folded like foldExtensionChar equals folded, which is folded already
+    bool (*equalFolded)(wchar_t const *folded, wchar_t const *name, size_t length);
+
+    // position of the first occurrence of text in name, NAME_NOT_FOUND if there is none
+    size_t (*find)(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength);
+};
+
+// the kernels for this CPU
+NameKernels const &nameKernels();
+
+// the kernels of one level, the best supported one below it if the CPU lacks it
+NameKernels const &nameKernels(NameKernelLevel level);
+
+char const *nameKernelLevelName(NameKernelLevel level);
@@ -0,0 +1,976 @@
+#include "Regex.h"
+
+#include <algorithm>
+#include <wctype.h>
+
+#include "ExtensionTable.h"
+#include "NameKernels.h"
+
+// states of the lazy DFA kept before the cache is dropped and built again
+#define MAX_DFA_STATES 4096
+// NFA states a pattern may expand to, bounds the work of counted repeats
+#define MAX_NFA_STATES 100000
+#define NO_STATE 0xffffffff
+
+size_t RegexPattern::SetHash::operator()(std::vector<uint32_t> const &set) const
+{
+    size_t h = 14695981039346656037ull & size_t(-1);
+    for (uint32_t id : set)
+    {
+        h = (h ^ id) * size_t(1099511628211ull);
+    }
+    return h;
+}
+
+bool RegexPattern::compile(std::wstring const &pattern, bool caseSensitive, wchar_t const *upcase)
+{
+    _pattern = pattern;
+    _caseSensitive = caseSensitive;
+    _upcase = caseSensitive ? nullptr : upcase;
+    _foldedNames = _upcase != nullptr;
+    _error.clear();
+    _position = 0;
+
+    _sets.clear();
+    _nfa.clear();
+    _setClasses.clear();
+    _literal.clear();
+    _resetDfa();
+
+    std::unique_ptr<Node> root = _parseAlternate();
+    if (root == nullptr)
+    {
+        return false;
+    }
+    if (_position < _pattern.length())
+    {
+        return _fail(_pattern[_position] == L')' ? "unmatched )" : "unexpected character");
+    }
+
+    _nfaLimit = MAX_NFA_STATES;
+
+    uint32_t match = _addState(NfaState::MATCH, 0);
+    _nfaStart = _build(root.get(), match);
+    if (_nfa.size() > MAX_NFA_STATES)
+    {
+        return _fail("pattern too large");
+    }
+
+    NfaState const &start = _nfa[_nfaStart];
+    _anchored = start.type == NfaState::BEGIN_LINE;
+
+    _buildClasses();
+    _literal = _bestLiteral(root.get());
+    _upcase = nullptr;
+
+    _resetDfa();
+    return true;
+}
+
+bool RegexPattern::_fail(char const *message)
+{
+    if (_error.empty())
+    {
+        _error = message;
+        _error += " at ";
+        _error += std::to_string(_position);
+    }
+    return false;
+}
+
+// parser
+
+std::unique_ptr<RegexPattern::Node> RegexPattern::_parseAlternate()
+{
+    std::unique_ptr<Node> first = _parseConcat();
+    if (first == nullptr || _position >= _pattern.length() || _pattern[_position] != L'|')
+    {
+        return first;
+    }
+
+    std::unique_ptr<Node> node(new Node);
+    node->type = Node::ALTERNATE;
+    node->children.push_back(std::move(first));
+
+    while (_position < _pattern.length() && _pattern[_position] == L'|')
+    {
+        _position++;
+        std::unique_ptr<Node> next = _parseConcat();
+        if (next == nullptr)
+        {
+            return nullptr;
+        }
+        node->children.push_back(std::move(next));
+    }
+    return node;
+}
+
+std::unique_ptr<RegexPattern::Node> RegexPattern::_parseConcat()
+{
+    std::unique_ptr<Node> node(new Node);
+    node->type = Node::CONCAT;
+
+    while (_position < _pattern.length() && _pattern[_position] != L'|' && _pattern[_position] != L')')
+    {
+        std::unique_ptr<Node> next = _parseRepeat();
+        if (next == nullptr)
+        {
+            return nullptr;
+        }
+        node->children.push_back(std::move(next));
+    }
+
+    if (node->children.size() == 1)
+    {
+        return std::move(node->children[0]);
+    }
+    if (node->children.empty())
+    {
+        node->type = Node::EMPTY;
+    }
+    return node;
+}
+
+bool RegexPattern::_parseNumber(uint32_t *value)
+{
+    size_t start = _position;
+    uint64_t n = 0;
+
+    while (_position < _pattern.length() && _pattern[_position] >= L'0' && _pattern[_position] <= L'9')
+    {
+        n = n * 10 + (_pattern[_position++] - L'0');
+        if (n > 1000)
+        {
+            return _fail("repeat count above 1000");
+        }
+    }
+
+    *value = uint32_t(n);
+    return _position > start;
+}
+
+std::unique_ptr<RegexPattern::Node> RegexPattern::_parseRepeat()
+{
+    std::unique_ptr<Node> atom = _parseAtom();
+    if (atom == nullptr)
+    {
+        return nullptr;
+    }
+
+    while (_position < _pattern.length())
+    {
+        wchar_t c = _pattern[_position];
+        uint32_t min, max;
+
+        if (c == L'*')
+        {
+            min = 0;
+            max = REPEAT_UNBOUNDED;
+            _position++;
+        }
+        else if (c == L'+')
+        {
+            min = 1;
+            max = REPEAT_UNBOUNDED;
+            _position++;
+        }
+        else if (c == L'?')
+        {
+            min = 0;
+            max = 1;
+            _position++;
+        }
+        else if (c == L'{')
+        {
+            size_t open = _position++;
+
+            if (!_parseNumber(&min))
+            {
+                if (!_error.empty())
+                {
+                    return nullptr;
+                }
+                // not a counted repeat, '{' is a literal
+                _position = open;
+                break;
+            }
+
+            max = min;
+            if (_position < _pattern.length() && _pattern[_position] == L',')
+            {
+                _position++;
+                if (!_parseNumber(&max))
+                {
+                    if (!_error.empty())
+                    {
+                        return nullptr;
+                    }
+                    max = REPEAT_UNBOUNDED;
+                }
+            }
+
+            if (_position >= _pattern.length() || _pattern[_position] != L'}')
+            {
+                _fail("missing }");
+                return nullptr;
+            }
+            _position++;
+
+            if (max < min)
+            {
+                _fail("repeat range out of order");
+                return nullptr;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        // lazy and greedy match the same names
+        if (_position < _pattern.length() && _pattern[_position] == L'?')
+        {
+            _position++;
+        }
+
+        if (atom->type == Node::BEGIN_LINE || atom->type == Node::END_LINE)
+        {
+            _fail("nothing to repeat");
+            return nullptr;
+        }
+
+        std::unique_ptr<Node> repeat(new Node);
+        repeat->type = Node::REPEAT;
+        repeat->min = min;
+        repeat->max = max;
+        repeat->children.push_back(std::move(atom));
+        atom = std::move(repeat);
+    }
+
+    return atom;
+}
+
+std::unique_ptr<RegexPattern::Node> RegexPattern::_setNode(std::vector<Range> set, uint32_t literal)
+{
+    std::unique_ptr<Node> node(new Node);
+    node->type = Node::SET;
+    node->literal = literal;
+
+    if (!_caseSensitive)
+    {
+        _addCases(set);
+    }
+    _normalize(set);
+    node->set = std::move(set);
+    return node;
+}
+
+std::unique_ptr<RegexPattern::Node> RegexPattern::_parseAtom()
+{
+    wchar_t c = _pattern[_position];
+
+    switch (c)
+    {
+        case L'(':
+        {
+            _position++;
+            if (_pattern.compare(_position, 2, L"?:") == 0)
+            {
+                _position += 2;
+            }
+
+            std::unique_ptr<Node> inner = _parseAlternate();
+            if (inner == nullptr)
+            {
+                return nullptr;
+            }
+            if (_position >= _pattern.length() || _pattern[_position] != L')')
+            {
+                _fail("missing )");
+                return nullptr;
+            }
+            _position++;
+            return inner;
+        }
+
+        case L'*':
+        case L'+':
+        case L'?':
+            _fail("nothing to repeat");
+            return nullptr;
+
+        case L'.':
+            _position++;
+            return _setNode({{0, 0xffff}}, 0xffffffff);
+
+        case L'^':
+        case L'$':
+        {
+            _position++;
+            std::unique_ptr<Node> node(new Node);
+            node->type = c == L'^' ? Node::BEGIN_LINE : Node::END_LINE;
+            return node;
+        }
+
+        case L'[':
+        {
+            _position++;
+            std::vector<Range> set;
+            if (!_parseClass(set))
+            {
+                return nullptr;
+            }
+            return _setNode(std::move(set), 0xffffffff);
+        }
+
+        case L'\\':
+        {
+            _position++;
+            std::vector<Range> set;
+            uint32_t literal = 0xffffffff;
+            if (!_parseEscape(set, &literal))
+            {
+                return nullptr;
+            }
+            return _setNode(std::move(set), literal);
+        }
+
+        default:
+            _position++;
+            return _setNode({{uint32_t(c), uint32_t(c)}}, uint32_t(c));
+    }
+}
+
+// after a backslash; literal is set for an escaped ordinary character
+bool RegexPattern::_parseEscape(std::vector<Range> &set, uint32_t *literal)
+{
+    if (_position >= _pattern.length())
+    {
+        return _fail("trailing backslash");
+    }
+
+    wchar_t c = _pattern[_position++];
+    std::vector<Range> cls;
+
+    switch (towlower(c))
+    {
+        case L'd':
+            cls = {{L'0', L'9'}};
+            break;
+        case L'w':
+            cls = {{L'0', L'9'}, {L'A', L'Z'}, {L'_', L'_'}, {L'a', L'z'}};
+            break;
+        case L's':
+            cls = {{L'\t', L'\r'}, {L' ', L' '}};
+            break;
+        default:
+        {
+            uint32_t value = c;
+            if (c == L't')
+            {
+                value = L'\t';
+            }
+            else if (c == L'n')
+            {
+                value = L'\n';
+            }
+            else if (c == L'r')
+            {
+                value = L'\r';
+            }
+            set.push_back({value, value});
+            *literal = value;
+            return true;
+        }
+    }
+
+    // \D \W \S
+    if (iswupper(c))
+    {
+        cls = _complement(cls);
+    }
+    set.insert(set.end(), cls.begin(), cls.end());
+    return true;
+}
+
+// after the opening bracket
+bool RegexPattern::_parseClass(std::vector<Range> &set)
+{
+    bool negated = _position < _pattern.length() && _pattern[_position] == L'^';
+    if (negated)
+    {
+        _position++;
+    }
+
+    size_t first = _position;
+    std::vector<Range> ranges;
+
+    while (true)
+    {
+        if (_position >= _pattern.length())
+        {
+            return _fail("missing ]");
+        }
+
+        wchar_t c = _pattern[_position];
+        if (c == L']' && _position != first)
+        {
+            _position++;
+            break;
+        }
+
+        uint32_t low;
+        _position++;
+
+        if (c == L'\\')
+        {
+            std::vector<Range> escaped;
+            uint32_t literal = 0xffffffff;
+            if (!_parseEscape(escaped, &literal))
+            {
+                return false;
+            }
+            if (literal == 0xffffffff)
+            {
+                // \d and the like, no range can start here
+                ranges.insert(ranges.end(), escaped.begin(), escaped.end());
+                continue;
+            }
+            low = literal;
+        }
+        else
+        {
+            low = c;
+        }
+
+        uint32_t high = low;
+
+        if (_position + 1 < _pattern.length() && _pattern[_position] == L'-' && _pattern[_position + 1] != L']')
+        {
+            _position++;
+            wchar_t h = _pattern[_position++];
+            if (h == L'\\')
+            {
+                std::vector<Range> escaped;
+                uint32_t literal = 0xffffffff;
+                if (!_parseEscape(escaped, &literal) || literal == 0xffffffff)
+                {
+                    return _fail("bad class range");
+                }
+                high = literal;
+            }
+            else
+            {
+                high = h;
+            }
+
+            if (high < low)
+            {
+                return _fail("class range out of order");
+            }
+        }
+
+        ranges.push_back({low, high});
+    }
+
+    if (!_caseSensitive)
+    {
+        // before negating, [^a] must not match 'A' either
+        _addCases(ranges);
+    }
+    _normalize(ranges);
+
+    set = negated ? _complement(ranges) : ranges;
+    return true;
+}
+
+void RegexPattern::_normalize(std::vector<Range> &set)
+{
+    std::sort(set.begin(), set.end(), [](Range const &a, Range const &b) { return a.low < b.low; });
+
+    size_t out = 0;
+    for (size_t i = 0; i < set.size(); i++)
+    {
+        if (out > 0 && set[i].low <= set[out - 1].high + 1)
+        {
+            set[out - 1].high = std::max(set[out - 1].high, set[i].high);
+        }
+        else
+        {
+            set[out++] = set[i];
+        }
+    }
+    set.resize(out);
+}
+
+std::vector<RegexPattern::Range> RegexPattern::_complement(std::vector<Range> const &set)
+{
+    std::vector<Range> sorted = set;
+    _normalize(sorted);
+
+    std::vector<Range> out;
+    uint32_t next = 0;
+    for (auto const &range : sorted)
+    {
+        if (range.low > next)
+        {
+            out.push_back({next, range.low - 1});
+        }
+        next = range.high + 1;
+    }
+    if (next <= 0xffff)
+    {
+        out.push_back({next, 0xffff});
+    }
+    return out;
+}
+
+// adds the other case of every character in the set
+void RegexPattern::_addCases(std::vector<Range> &set) const
+{
+    size_t count = set.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        Range range = set[i];
+
+        // letters are rare outside these, whole classes like '.' are not walked
+        if (range.high - range.low > 0x3000)
+        {
+            continue;
+        }
+
+        for (uint32_t c = range.low; c <= range.high; c++)
+        {
+            uint32_t lower = uint32_t(towlower(wchar_t(c)));
+            uint32_t upper = uint32_t(towupper(wchar_t(c)));
+            if (lower != c && lower <= 0xffff)
+            {
+                set.push_back({lower, lower});
+            }
+            if (upper != c && upper <= 0xffff)
+            {
+                set.push_back({upper, upper});
+            }
+            if (_upcase != nullptr)
+            {
+                uint32_t folded = uint16_t(_upcase[c]);
+                set.push_back({folded, folded});
+            }
+        }
+    }
+}
+
+// NFA, built back to front: each node is given the state that follows it
+
+uint32_t RegexPattern::_addState(NfaState::Type type, uint32_t out, uint32_t out1, uint32_t set)
+{
+    _nfa.push_back({type, out, out1, set});
+    return uint32_t(_nfa.size() - 1);
+}
+
+uint32_t RegexPattern::_build(Node const *node, uint32_t next)
+{
+    // counted repeats of large groups stop growing here, compile() reports it
+    if (_nfa.size() > _nfaLimit)
+    {
+        return next;
+    }
+
+    switch (node->type)
+    {
+        case Node::SET:
+            _sets.push_back(node->set);
+            return _addState(NfaState::CHAR, next, 0, uint32_t(_sets.size() - 1));
+
+        case Node::CONCAT:
+            for (size_t i = node->children.size(); i > 0; i--)
+            {
+                next = _build(node->children[i - 1].get(), next);
+            }
+            return next;
+
+        case Node::ALTERNATE:
+        {
+            uint32_t start = _build(node->children.back().get(), next);
+            for (size_t i = node->children.size() - 1; i > 0; i--)
+            {
+                uint32_t branch = _build(node->children[i - 1].get(), next);
+                start = _addState(NfaState::SPLIT, branch, start);
+            }
+            return start;
+        }
+
+        case Node::REPEAT:
+        {
+            Node const *child = node->children[0].get();
+            uint32_t start = next;
+
+            if (node->max == REPEAT_UNBOUNDED)
+            {
+                // loop: either another round of the child or on
+                uint32_t loop = _addState(NfaState::SPLIT, 0, next);
+                _nfa[loop].out = _build(child, loop);
+                start = loop;
+            }
+            else
+            {
+                for (uint32_t i = node->min; i < node->max; i++)
+                {
+                    uint32_t body = _build(child, start);
+                    start = _addState(NfaState::SPLIT, body, next);
+                }
+            }
+
+            for (uint32_t i = 0; i < node->min; i++)
+            {
+                start = _build(child, start);
+            }
+            return start;
+        }
+
+        case Node::BEGIN_LINE:
+            return _addState(NfaState::BEGIN_LINE, next);
+
+        case Node::END_LINE:
+            return _addState(NfaState::END_LINE, next);
+
+        case Node::EMPTY:
+        default:
+            return next;
+    }
+}
+
+// Splits the code units into the classes no set of the pattern tells apart, and
+// turns every set into one bit per class.
+
+void RegexPattern::_buildClasses()
+{
+    std::vector<uint32_t> bounds = {0, 0x10000};
+    for (auto const &set : _sets)
+    {
+        for (auto const &range : set)
+        {
+            bounds.push_back(range.low);
+            bounds.push_back(range.high + 1);
+        }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    _classCount = uint32_t(bounds.size() - 1);
+    _classOf.assign(0x10000, 0);
+    for (uint32_t cls = 0; cls < _classCount; cls++)
+    {
+        std::fill(_classOf.begin() + bounds[cls], _classOf.begin() + bounds[cls + 1], uint16_t(cls));
+    }
+
+    size_t words = (_classCount + 63) / 64;
+    _setClasses.assign(_sets.size(), std::vector<uint64_t>(words, 0));
+
+    for (size_t s = 0; s < _sets.size(); s++)
+    {
+        for (auto const &range : _sets[s])
+        {
+            for (uint32_t cls = _classOf[range.low]; cls <= _classOf[range.high]; cls++)
+            {
+                _setClasses[s][cls >> 6] |= 1ull << (cls & 63);
+            }
+        }
+    }
+
+    _sets.clear();
+}
+
+// Longest run of plain characters that every match has to contain. Only characters that
+// fold the same way in the name are used when case does not matter.
+
+std::wstring RegexPattern::_bestLiteral(Node const *node) const
+{
+    auto plain = [&](Node const *n) {
+        return n->type == Node::SET && n->literal != 0xffffffff && (_caseSensitive || n->literal < 0x80);
+    };
+    auto character = [&](Node const *n) {
+        if (_caseSensitive)
+        {
+            return wchar_t(n->literal);
+        }
+        return _upcase != nullptr ? _upcase[n->literal] : foldExtensionChar(wchar_t(n->literal));
+    };
+
+    if (plain(node))
+    {
+        return std::wstring(1, character(node));
+    }
+
+    std::wstring best;
+
+    if (node->type == Node::CONCAT)
+    {
+        std::wstring run;
+        for (auto const &child : node->children)
+        {
+            if (plain(child.get()))
+            {
+                run.push_back(character(child.get()));
+                continue;
+            }
+
+            if (run.length() > best.length())
+            {
+                best = run;
+            }
+            run.clear();
+
+            std::wstring inner = _bestLiteral(child.get());
+            if (inner.length() > best.length())
+            {
+                best = inner;
+            }
+        }
+        if (run.length() > best.length())
+        {
+            best = run;
+        }
+    }
+    else if (node->type == Node::REPEAT && node->min > 0)
+    {
+        best = _bestLiteral(node->children[0].get());
+    }
+
+    return best;
+}
+
+// DFA
+
+void RegexPattern::_closure(std::vector<uint32_t> &seeds, bool atStart, std::vector<uint32_t> &set)
+{
+    if (_visited.size() < _nfa.size())
+    {
+        _visited.assign(_nfa.size(), 0);
+        _generation = 0;
+    }
+    if (++_generation == 0)
+    {
+        std::fill(_visited.begin(), _visited.end(), 0);
+        _generation = 1;
+    }
+
+    set.clear();
+
+    while (!seeds.empty())
+    {
+        uint32_t id = seeds.back();
+        seeds.pop_back();
+
+        if (_visited[id] == _generation)
+        {
+            continue;
+        }
+        _visited[id] = _generation;
+
+        NfaState const &state = _nfa[id];
+        switch (state.type)
+        {
+            case NfaState::SPLIT:
+                seeds.push_back(state.out1);
+                seeds.push_back(state.out);
+                break;
+
+            case NfaState::BEGIN_LINE:
+                if (atStart)
+                {
+                    seeds.push_back(state.out);
+                }
+                break;
+
+            default:
+                // CHAR, END_LINE and MATCH tell DFA states apart
+                set.push_back(id);
+                break;
+        }
+    }
+
+    std::sort(set.begin(), set.end());
+}
+
+bool RegexPattern::_acceptsAtEnd(std::vector<uint32_t> const &set)
+{
+    std::vector<uint32_t> seeds;
+    for (uint32_t id : set)
+    {
+        if (_nfa[id].type == NfaState::MATCH)
+        {
+            return true;
+        }
+        if (_nfa[id].type == NfaState::END_LINE)
+        {
+            seeds.push_back(_nfa[id].out);
+        }
+    }
+
+    // past a '$' only more anchors can follow
+    std::vector<uint32_t> reached;
+    while (!seeds.empty())
+    {
+        _closure(seeds, false, reached);
+        for (uint32_t id : reached)
+        {
+            if (_nfa[id].type == NfaState::MATCH)
+            {
+                return true;
+            }
+            if (_nfa[id].type == NfaState::END_LINE)
+            {
+                seeds.push_back(_nfa[id].out);
+            }
+        }
+    }
+    return false;
+}
+
+uint32_t RegexPattern::_dfaState(std::vector<uint32_t> &set)
+{
+    auto found = _stateOf.find(set);
+    if (found != _stateOf.end())
+    {
+        return found->second;
+    }
+
+    DfaState state;
+    state.nfa = set;
+    state.dead = set.empty();
+    for (uint32_t id : set)
+    {
+        state.match |= _nfa[id].type == NfaState::MATCH;
+    }
+    state.matchAtEnd = state.match || _acceptsAtEnd(set);
+
+    uint32_t index = uint32_t(_states.size());
+    _states.push_back(std::move(state));
+    _stateOf.emplace(set, index);
+    _transitions.resize(_transitions.size() + _classCount, NO_STATE);
+    return index;
+}
+
+void RegexPattern::_resetDfa()
+{
+    _states.clear();
+    _transitions.clear();
+    _stateOf.clear();
+    _restart.clear();
+
+    if (_nfa.empty())
+    {
+        return;
+    }
+
+    std::vector<uint32_t> seeds = {_nfaStart};
+    std::vector<uint32_t> set;
+
+    _closure(seeds, true, set);
+    _dfaState(set);
+
+    // unanchored: a match may begin at any later character too
+    if (!_anchored)
+    {
+        seeds = {_nfaStart};
+        _closure(seeds, false, _restart);
+    }
+}
+
+uint32_t RegexPattern::_step(uint32_t state, uint32_t cls)
+{
+    std::vector<uint32_t> seeds = _restart;
+
+    for (uint32_t id : _states[state].nfa)
+    {
+        NfaState const &nfa = _nfa[id];
+        if (nfa.type == NfaState::CHAR && ((_setClasses[nfa.set][cls >> 6] >> (cls & 63)) & 1))
+        {
+            seeds.push_back(nfa.out);
+        }
+    }
+
+    std::vector<uint32_t> set;
+    _closure(seeds, false, set);
+
+    if (_states.size() >= MAX_DFA_STATES)
+    {
+        // the cache is full, start over with only what this name needs
+        _resetDfa();
+        return _dfaState(set);
+    }
+
+    uint32_t next = _dfaState(set);
+    _transitions[size_t(state) * _classCount + cls] = next;
+    return next;
+}
+
+bool RegexPattern::_containsLiteral(wchar_t const *name, size_t length) const
+{
+    size_t n = _literal.length();
+    if (n > length)
+    {
+        return false;
+    }
+
+    if (_caseSensitive || _foldedNames)
+    {
+        return nameKernels().find(name, length, _literal.data(), n) != NAME_NOT_FOUND;
+    }
+
+    wchar_t first = _literal[0];
+    for (size_t i = 0; i + n <= length; i++)
+    {
+        wchar_t c = foldExtensionChar(name[i]);
+        if (c != first)
+        {
+            continue;
+        }
+
+        size_t k = 1;
+        while (k < n && foldExtensionChar(name[i + k]) == _literal[k])
+        {
+            k++;
+        }
+        if (k == n)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RegexPattern::match(wchar_t const *name, size_t length)
+{
+    if (_states.empty())
+    {
+        return false;
+    }
+
+    if (!_literal.empty() && !_containsLiteral(name, length))
+    {
+        return false;
+    }
+
+    uint32_t state = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        DfaState const &current = _states[state];
+        if (current.match)
+        {
+            return true;
+        }
+        if (current.dead)
+        {
+            return false;
+        }
+
+        uint32_t cls = _classOf[uint16_t(name[i])];
+        uint32_t next = _transitions[size_t(state) * _classCount + cls];
+        state = next != NO_STATE ? next : _step(state, cls);
+    }
+
+    return _states[state].matchAtEnd;
+}
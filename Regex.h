@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Regular expression over the UTF-16 code units of a file name.
+//
+// Supported: literals, '.', [a-z] / [^a-z] classes, \d \w \s and their negations, groups
+// ( ) and (?: ), alternation '|', the quantifiers * + ? {m} {m,} {m,n} (a trailing '?'
+// for lazy matching is accepted and ignored), and ^ $ anchors. Without ^ a pattern
+// matches anywhere in the name, like std::regex_search.
+//
+// The pattern is parsed into a Thompson NFA once. Matching runs a DFA that is built
+// lazily from it: each DFA state is a set of NFA states, created the first time a name
+// leads to it, so a name costs one table lookup per character and repeated queries reuse
+// the states found before. Characters are mapped to the classes the pattern can tell
+// apart, which keeps the transition table small.
+//
+// A literal that every match must contain is searched for first, the DFA only sees the
+// names that contain it.
+//
+// Compiled with a volume's $UpCase table, a case insensitive pattern expects names folded
+// through it, DiskHandle::foldedNames, and matches them without folding anything.
+//
+// match() extends the DFA as it goes, one compiled pattern must not be used by several
+// threads at once.
+
+class RegexPattern
+{
+public:
+    RegexPattern()
+    {
+    }
+
+    // false with error() set when the pattern is malformed; upcase is only read here
+    bool compile(std::wstring const &pattern, bool caseSensitive, wchar_t const *upcase = nullptr);
+
+    bool match(wchar_t const *name, size_t length);
+
+    std::wstring const &pattern() const
+    {
+        return _pattern;
+    }
+
+    bool caseSensitive() const
+    {
+        return _caseSensitive;
+    }
+
+    std::string const &error() const
+    {
+        return _error;
+    }
+
+    // the literal every match contains, empty if there is none
+    std::wstring const &requiredLiteral() const
+    {
+        return _literal;
+    }
+
+    size_t dfaStates() const
+    {
+        return _states.size();
+    }
+
+private:
+    struct Range
+    {
+        uint32_t low;
+        uint32_t high;
+    };
+
+    // parse tree
+    struct Node
+    {
+        enum Type
+        {
+            SET,
+            CONCAT,
+            ALTERNATE,
+            REPEAT,
+            EMPTY,
+            BEGIN_LINE,
+            END_LINE
+        };
+
+        Type type = EMPTY;
+        std::vector<std::unique_ptr<Node>> children;
+        std::vector<Range> set;
+        uint32_t literal = 0xffffffff; // the character of a plain literal SET
+        uint32_t min = 0;
+        uint32_t max = 0; // REPEAT_UNBOUNDED for no limit
+    };
+
+    struct NfaState
+    {
+        enum Type : uint8_t
+        {
+            CHAR,
+            SPLIT,
+            BEGIN_LINE,
+            END_LINE,
+            MATCH
+        };
+
+        Type type;
+        uint32_t out;
+        uint32_t out1;
+        uint32_t set; // CHAR: index into _sets
+    };
+
+    struct DfaState
+    {
+        std::vector<uint32_t> nfa; // sorted
+        bool match = false;        // a match ends here, the rest of the name does not matter
+        bool matchAtEnd = false;   // a match ends here if the name ends here
+        bool dead = false;         // no match can follow
+    };
+
+    struct SetHash
+    {
+        size_t operator()(std::vector<uint32_t> const &set) const;
+    };
+
+    static const uint32_t REPEAT_UNBOUNDED = 0xffffffff;
+
+    // parser
+    std::unique_ptr<Node> _parseAlternate();
+    std::unique_ptr<Node> _parseConcat();
+    std::unique_ptr<Node> _parseRepeat();
+    std::unique_ptr<Node> _parseAtom();
+    bool _parseClass(std::vector<Range> &set);
+    bool _parseEscape(std::vector<Range> &set, uint32_t *literal);
+    bool _parseNumber(uint32_t *value);
+    std::unique_ptr<Node> _setNode(std::vector<Range> set, uint32_t literal);
+    bool _fail(char const *message);
+
+    static void _normalize(std::vector<Range> &set);
+    static std::vector<Range> _complement(std::vector<Range> const &set);
+    void _addCases(std::vector<Range> &set) const;
+
+    // NFA construction
+    uint32_t _build(Node const *node, uint32_t next);
+    uint32_t _addState(NfaState::Type type, uint32_t out, uint32_t out1 = 0, uint32_t set = 0);
+    void _buildClasses();
+
+    std::wstring _bestLiteral(Node const *node) const;
+
+    // DFA
+    void _closure(std::vector<uint32_t> &seeds, bool atStart, std::vector<uint32_t> &set);
+    bool _acceptsAtEnd(std::vector<uint32_t> const &set);
+    uint32_t _dfaState(std::vector<uint32_t> &set);
+    uint32_t _step(uint32_t state, uint32_t cls);
+    void _resetDfa();
+
+    bool _containsLiteral(wchar_t const *name, size_t length) const;
+
+    std::wstring _pattern;
+    bool _caseSensitive = false;
+    bool _foldedNames = false;
+    wchar_t const *_upcase = nullptr; // while compiling
+    std::string _error;
+    size_t _position = 0;
+    uint32_t _nfaLimit = 0;
+
+    std::vector<std::vector<Range>> _sets; // while building, then replaced by class bits
+    std::vector<NfaState> _nfa;
+    uint32_t _nfaStart = 0;
+    bool _anchored = false; // every match starts at the beginning of the name
+
+    // code unit -> class, and per CHAR set one bit per class
+    std::vector<uint16_t> _classOf;
+    uint32_t _classCount = 0;
+    std::vector<std::vector<uint64_t>> _setClasses;
+
+    std::vector<DfaState> _states;
+    std::vector<uint32_t> _transitions; // state * _classCount + class, NO_STATE if unknown
+    std::unordered_map<std::vector<uint32_t>, uint32_t, SetHash> _stateOf;
+    std::vector<uint32_t> _restart; // closure of the start, added at every step unless anchored
+
+    std::vector<uint32_t> _visited;
+    uint32_t _generation = 0;
+
+    std::wstring _literal; // folded when not case sensitive
+};
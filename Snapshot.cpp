@@ -0,0 +1,292 @@
+#include "Snapshot.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "Utf8.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SnapshotWriter::~SnapshotWriter()
+{
+    // not committed, drop the partial file
+    if (!_path.empty())
+    {
+        _close();
+#ifdef _WIN32
+        std::wstring tmp = decodeUtf8(_path.data(), _path.length()) + L".tmp";
+        DeleteFileW(tmp.c_str());
+#else
+        unlink((_path + ".tmp").c_str());
+#endif
+    }
+}
+
+bool SnapshotWriter::align()
+{
+    static const char zeros[SNAPSHOT_ALIGNMENT] = {};
+
+    size_t pad = size_t((SNAPSHOT_ALIGNMENT - _position % SNAPSHOT_ALIGNMENT) % SNAPSHOT_ALIGNMENT);
+    return pad == 0 || write(zeros, pad);
+}
+
+#ifdef _WIN32
+
+MappedFile::~MappedFile()
+{
+    if (_data != nullptr)
+    {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping != nullptr)
+    {
+        CloseHandle(_mapping);
+    }
+    if (_file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_file);
+    }
+}
+
+bool MappedFile::open(std::string const &path)
+{
+    std::wstring widePath = decodeUtf8(path.data(), path.length());
+
+    _file = CreateFileW(widePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+    {
+        return false;
+    }
+
+    _mapping = CreateFileMappingW(_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    if (_mapping == nullptr)
+    {
+        return false;
+    }
+
+    _data = (uint8_t *)MapViewOfFile(_mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (_data == nullptr)
+    {
+        return false;
+    }
+
+    _size = uint64_t(size.QuadPart);
+    return true;
+}
+
+bool SnapshotWriter::open(std::string const &path)
+{
+    std::wstring tmp = decodeUtf8(path.data(), path.length()) + L".tmp";
+
+    _handle = CreateFileW(tmp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (_handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    _path = path;
+    _position = 0;
+    _failed = false;
+    return true;
+}
+
+bool SnapshotWriter::write(void const *data, size_t size)
+{
+    uint8_t const *src = (uint8_t const *)data;
+
+    while (size > 0 && !_failed)
+    {
+        DWORD chunk = DWORD(std::min<size_t>(size, 64 * 1024 * 1024));
+        DWORD written = 0;
+
+        if (!WriteFile(_handle, src, chunk, &written, nullptr) || written != chunk)
+        {
+            _failed = true;
+            break;
+        }
+
+        src += chunk;
+        size -= chunk;
+        _position += chunk;
+    }
+
+    return !_failed;
+}
+
+bool SnapshotWriter::writeAt(uint64_t offset, void const *data, size_t size)
+{
+    LARGE_INTEGER to;
+    to.QuadPart = offset;
+
+    uint64_t position = _position;
+    if (_failed || !SetFilePointerEx(_handle, to, nullptr, FILE_BEGIN))
+    {
+        _failed = true;
+        return false;
+    }
+
+    _position = offset;
+    bool ok = write(data, size);
+
+    to.QuadPart = position;
+    if (!SetFilePointerEx(_handle, to, nullptr, FILE_BEGIN))
+    {
+        _failed = true;
+        return false;
+    }
+    _position = position;
+
+    return ok;
+}
+
+void SnapshotWriter::_close()
+{
+    if (_handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_handle);
+        _handle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool SnapshotWriter::commit()
+{
+    bool ok = !_failed && FlushFileBuffers(_handle);
+    _close();
+
+    std::wstring path = decodeUtf8(_path.data(), _path.length());
+    std::wstring tmp = path + L".tmp";
+
+    ok = ok && MoveFileExW(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    if (!ok)
+    {
+        DeleteFileW(tmp.c_str());
+    }
+
+    _path.clear();
+    return ok;
+}
+
+#else
+
+MappedFile::~MappedFile()
+{
+    if (_data != nullptr)
+    {
+        munmap(_data, size_t(_size));
+    }
+}
+
+bool MappedFile::open(std::string const &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // the mapping keeps the file referenced after the descriptor is closed
+    void *data = mmap(nullptr, size_t(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    _data = (uint8_t *)data;
+    _size = uint64_t(info.st_size);
+    return true;
+}
+
+bool SnapshotWriter::open(std::string const &path)
+{
+    _fd = ::open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_fd < 0)
+    {
+        return false;
+    }
+
+    _path = path;
+    _position = 0;
+    _failed = false;
+    return true;
+}
+
+bool SnapshotWriter::write(void const *data, size_t size)
+{
+    if (writeAt(_position, data, size))
+    {
+        _position += size;
+        return true;
+    }
+    return false;
+}
+
+bool SnapshotWriter::writeAt(uint64_t offset, void const *data, size_t size)
+{
+    uint8_t const *src = (uint8_t const *)data;
+
+    while (size > 0 && !_failed)
+    {
+        ssize_t written = pwrite(_fd, src, size, off_t(offset));
+        if (written <= 0)
+        {
+            _failed = true;
+            break;
+        }
+
+        src += written;
+        size -= size_t(written);
+        offset += uint64_t(written);
+    }
+
+    return !_failed;
+}
+
+void SnapshotWriter::_close()
+{
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+bool SnapshotWriter::commit()
+{
+    bool ok = !_failed && fsync(_fd) == 0;
+    _close();
+
+    std::string tmp = _path + ".tmp";
+
+    ok = ok && rename(tmp.c_str(), _path.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+
+    _path.clear();
+    return ok;
+}
+
+#endif
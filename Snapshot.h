@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Layout of a snapshot file, all little endian:
+//
+//   SnapshotHeader
+//   FileEntry[filesSize]                          at filesOffset
+//   name chunks, nameChunks * nameChunkSize wchar  at namesOffset
+//   the same chunks folded through $UpCase          at foldedOffset
+//   LongFileInfo[detailsCount]                    at detailsOffset, only with file details
+//   SnapshotExtension[extensionCount]             at extensionsOffset
+//   extension keys, wchar                         at extensionKeysOffset
+//   record ids of all extensions, uint32_t        at extensionIdsOffset
+//
+// Sections start on SNAPSHOT_ALIGNMENT boundaries. The volume serial number tells whether
+// the snapshot belongs to the volume it is loaded against; the USN journal position, or
+// the size of $MFT when the volume has no journal, whether it is still current.
+//
+// Nothing in the file is a pointer: names are found by their arena offset, which maps
+// straight onto the name chunks, so a loaded snapshot is mapped and searched in place.
+// The folded names case insensitive searches compare are saved too, with the hash of the
+// $UpCase table they were folded with, and are mapped the same way.
+
+#define SNAPSHOT_MAGIC "NTFSIDX"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_ALIGNMENT 4096
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+
+    uint64_t serialNumber;
+    uint64_t sizeMFT;
+    uint32_t bytesPerFileRecord;
+    uint32_t filesSize;
+    uint32_t realFiles;
+    uint32_t nameChunkSize;
+    uint32_t nameChunks;
+    uint32_t detailsCount;
+
+    uint64_t filesOffset;
+    uint64_t namesOffset;
+    uint64_t detailsOffset;
+
+    // total length, a truncated file is rejected
+    uint64_t fileSize;
+
+    uint32_t extensionCount;
+    uint32_t extensionKeysLength; // characters
+    uint64_t extensionIdsCount;
+    uint64_t extensionsOffset;
+    uint64_t extensionKeysOffset;
+    uint64_t extensionIdsOffset;
+
+    // $UsnJrnl position the tables reflect, journal id 0 if there is none
+    uint32_t usnJournalRecord;
+    uint32_t reserved;
+    uint64_t usnJournalId;
+    uint64_t usnCursor;
+
+    // nameChunks folded chunks
+    uint64_t foldedOffset;
+    uint64_t upcaseHash;
+};
+
+// one posting list of the extension index
+struct SnapshotExtension
+{
+    uint32_t keyOffset; // characters into the key section
+    uint32_t keyLength;
+    uint64_t idsOffset; // ids into the id section
+    uint64_t idsCount;
+};
+
+// Read only view of a whole file, mapped copy on write so that entries can still be
+// patched in memory without touching the file or the other processes sharing it.
+
+class MappedFile
+{
+public:
+    MappedFile()
+    {
+    }
+    ~MappedFile();
+
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+
+    // path is UTF-8
+    bool open(std::string const &path);
+
+    uint8_t *data() const
+    {
+        return _data;
+    }
+
+    uint64_t size() const
+    {
+        return _size;
+    }
+
+private:
+    uint8_t *_data = nullptr;
+    uint64_t _size = 0;
+
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#endif
+};
+
+// Writes a snapshot to path.tmp and moves it over path on commit(), so readers never see
+// a half written file.
+
+class SnapshotWriter
+{
+public:
+    SnapshotWriter()
+    {
+    }
+    ~SnapshotWriter();
+
+    // path is UTF-8
+    bool open(std::string const &path);
+
+    bool write(void const *data, size_t size);
+    bool writeAt(uint64_t offset, void const *data, size_t size);
+
+    // pads with zeros up to the next SNAPSHOT_ALIGNMENT boundary
+    bool align();
+
+    uint64_t position() const
+    {
+        return _position;
+    }
+
+    bool commit();
+
+private:
+    void _close();
+
+    std::string _path;
+    uint64_t _position = 0;
+    bool _failed = false;
+
+#ifdef _WIN32
+    HANDLE _handle = INVALID_HANDLE_VALUE;
+#else
+    int _fd = -1;
+#endif
+};
@@ -1,8 +1,13 @@
 #include "NTFSDirectorySystem.h"
 
+#include <chrono>
 #include <memory>
+#include <random>
+#include <string.h>
 #include <assert.h>
 
+#include "NameKernels.h"
+
 // null terminated
 static const char *imageExtension[] = {
     //
@@ -39,15 +44,154 @@ void signalDirectoryProgress(size_t n, size_t total, String const &text)
     fflush(stdout);
 }
 
-int main()
+// Times the name kernels of every level, and the CRT calls they replace, on made up
+// names packed like the name arena: the extension lookup, an extension compare and a
+// substring search per name, each in a loop of its own. The names fit in the cache and
+// are run over many times, a single pass over a large arena is bound by memory bandwidth
+// rather than by the loops.
+
+struct BenchNames
+{
+    std::vector<wchar_t> arena;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+    std::vector<size_t> dots; // found before timing, the extension compare starts from them
+};
+
+// ms for 50 passes of test(name, n) over every name, the results are summed into found
+template <class _Test> static double timeNames(BenchNames const &names, size_t *found, _Test test)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t k = 0; k < 50 * names.offsets.size(); k++)
+    {
+        size_t n = k % names.offsets.size();
+        *found += test(names.arena.data() + names.offsets[n], n);
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void printBenchRow(char const *name, double const *ms, double const *baseline, size_t const *found)
 {
+    // the counts keep the loops from being optimized away, and must be the same in every row
+    printf("%-6s last dot %7.2f ms (%.2fx)  extension %7.2f ms (%.2fx)  substring %7.2f ms (%.2fx)  [%zu %zu %zu]\n",
+           name, ms[0], baseline[0] / ms[0], ms[1], baseline[1] / ms[1], ms[2], baseline[2] / ms[2], found[0], found[1],
+           found[2]);
+}
+
+static void benchmarkNameKernels()
+{
+    static const wchar_t letters[] = L"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 _-";
+    static const wchar_t *extensions[] = {L"jpg", L"txt", L"dll", L"JPG", L"h", L"cpp", L"json", L"png"};
+
+    std::mt19937 random(1);
+    BenchNames names;
+
+    for (int n = 0; n < 65536; n++)
+    {
+        names.offsets.push_back(uint32_t(names.arena.size()));
+
+        uint32_t length = 4 + random() % 40;
+        for (uint32_t i = 0; i < length; i++)
+        {
+            names.arena.push_back(letters[random() % (sizeof(letters) / sizeof(wchar_t) - 1)]);
+        }
+        if (random() % 8 == 0)
+        {
+            wchar_t const *report = L"Report";
+            names.arena.insert(names.arena.end(), report, report + wcslen(report));
+        }
+        names.arena.push_back(L'.');
+        wchar_t const *extension = extensions[random() % 8];
+        names.arena.insert(names.arena.end(), extension, extension + wcslen(extension));
+
+        names.lengths.push_back(uint32_t(names.arena.size()) - names.offsets.back());
+        names.arena.push_back(L'\0');
+    }
+
+    NameKernels const &scalar = nameKernels(NAME_KERNELS_SCALAR);
+    for (size_t n = 0; n < names.offsets.size(); n++)
+    {
+        names.dots.push_back(scalar.findLastDot(names.arena.data() + names.offsets[n], names.lengths[n]));
+    }
+
+    wchar_t const *key = L"jpg";
+    wchar_t const *text = L"Report";
+
+    auto hasKey = [&](size_t n) {
+        return names.dots[n] != NAME_NOT_FOUND && names.lengths[n] - names.dots[n] - 1 == 3;
+    };
+
+    // the calls the kernels replaced are the baseline
+    double crt[3];
+    size_t crtFound[3] = {};
+
+    crt[0] = timeNames(names, &crtFound[0], [&](wchar_t const *name, size_t) {
+        wchar_t const *dot = wcsrchr(name, L'.');
+        return dot != nullptr ? size_t(dot - name) : NAME_NOT_FOUND;
+    });
+    crt[1] = timeNames(names, &crtFound[1], [&](wchar_t const *name, size_t n) {
+        return hasKey(n) && _wcsnicmp(name + names.dots[n] + 1, key, 3) == 0;
+    });
+    crt[2] = timeNames(names, &crtFound[2], [&](wchar_t const *name, size_t) { return wcsstr(name, text) != nullptr; });
+
+    printBenchRow("CRT", crt, crt, crtFound);
+
+    for (int level = NAME_KERNELS_SCALAR; level <= NAME_KERNELS_AVX2; level++)
+    {
+        NameKernels const &kernels = nameKernels(NameKernelLevel(level));
+        if (kernels.level != level)
+        {
+            printf("%-6s not supported\n", nameKernelLevelName(NameKernelLevel(level)));
+            continue;
+        }
+
+        double ms[3];
+        size_t found[3] = {};
+
+        ms[0] = timeNames(names, &found[0], [&](wchar_t const *name, size_t n) {
+            return kernels.findLastDot(name, names.lengths[n]);
+        });
+        ms[1] = timeNames(names, &found[1], [&](wchar_t const *name, size_t n) {
+            return hasKey(n) && kernels.equalFolded(key, name + names.dots[n] + 1, 3);
+        });
+        ms[2] = timeNames(names, &found[2], [&](wchar_t const *name, size_t n) {
+            return kernels.find(name, names.lengths[n], text, 6) != NAME_NOT_FOUND;
+        });
+
+        printBenchRow(nameKernelLevelName(NameKernelLevel(level)), ms, crt, found);
+    }
+}
+
+// TestApp [image]
+// with no argument drive C: is scanned, otherwise the NTFS image or block device given
+// TestApp --bench-names times the name kernels
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--bench-names") == 0)
+    {
+        benchmarkNameKernels();
+        return 0;
+    }
+
 
     USet<String> extensions = imageExtensions();
 
     NTFSDirectorySystem ntfs;
 
     uint32_t driveMask = DISK_C;
-    bool success = ntfs.readDisks(driveMask);
+    bool success;
+    if (argc > 1)
+    {
+        driveMask = DISK_A;
+        success = ntfs.readImage(0, argv[1]);
+    }
+    else
+    {
+        success = ntfs.readDisks(driveMask);
+    }
     if (success)
     {
         ntfs.searchForFilesViaExtensions(driveMask, extensions);
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "NameKernels.h"
+
+// true if text occurs in name
+inline bool containsText(wchar_t const *name, size_t length, wchar_t const *text, size_t textLength)
+{
+    return nameKernels().find(name, length, text, textLength) != NAME_NOT_FOUND;
+}
+
+// Posting lists of the trigrams of all names: every three consecutive characters of a
+// name, with the records whose name contains them. The names are indexed as given, a
+// case insensitive index is built from the folded names and queried with folded text.
+//
+// A substring query looks up the trigrams of its text and intersects their lists, rarest
+// first, so only a few records are left to check against the text itself. Checking is
+// still needed, the trigrams of a name need not be next to each other.
+//
+// The lists are in record order and stored as varint deltas, mostly one byte per entry.
+// The index is built in one go from the names and not changed afterwards.
+
+class TrigramIndex
+{
+public:
+    TrigramIndex()
+    {
+    }
+
+    // nameOf(id, &length) gives the name of record id, nullptr to leave it out
+    template <class _NameOf> void build(uint32_t records, _NameOf nameOf)
+    {
+        clear();
+        _table.assign(1024, 0);
+
+        std::vector<uint64_t> grams;
+        std::vector<uint32_t> last;
+
+        // sizes first, then the lists are written into one buffer
+        for (int pass = 0; pass < 2; pass++)
+        {
+            last.assign(_postings.size(), 0);
+
+            for (uint32_t id = 0; id < records; id++)
+            {
+                uint32_t length = 0;
+                wchar_t const *name = nameOf(id, &length);
+                if (name == nullptr || !_trigrams(name, length, grams))
+                {
+                    continue;
+                }
+
+                for (uint64_t key : grams)
+                {
+                    uint32_t slot = pass == 0 ? _add(key) : _find(key);
+                    if (slot == last.size())
+                    {
+                        last.push_back(0);
+                    }
+
+                    Posting &posting = _postings[slot];
+                    uint32_t delta = id - last[slot];
+                    last[slot] = id;
+
+                    if (pass == 0)
+                    {
+                        posting.bytes += _varintSize(delta);
+                        posting.count++;
+                    }
+                    else
+                    {
+                        _writeVarint(&_data[posting.offset + posting.written], delta, &posting.written);
+                    }
+                }
+            }
+
+            if (pass == 0)
+            {
+                uint64_t offset = 0;
+                for (auto &posting : _postings)
+                {
+                    posting.offset = offset;
+                    offset += posting.bytes;
+                }
+                _data.assign(size_t(offset), 0);
+            }
+        }
+
+        _records = records;
+        _built = true;
+    }
+
+    // Records that may contain text, in record order. False if text is shorter than a
+    // trigram, the index cannot narrow those down.
+    bool candidates(wchar_t const *text, size_t length, std::vector<uint32_t> &ids) const
+    {
+        ids.clear();
+
+        std::vector<uint64_t> grams;
+        if (!_trigrams(text, uint32_t(length), grams))
+        {
+            return false;
+        }
+
+        std::vector<Posting const *> lists;
+        for (uint64_t key : grams)
+        {
+            uint32_t slot = _find(key);
+            if (slot == NOT_FOUND)
+            {
+                return true;
+            }
+            lists.push_back(&_postings[slot]);
+        }
+
+        std::sort(lists.begin(), lists.end(),
+                  [](Posting const *a, Posting const *b) { return a->count < b->count; });
+
+        ids.reserve(lists[0]->count);
+        _decode(*lists[0], [&](uint32_t id) {
+            ids.push_back(id);
+            return true;
+        });
+
+        for (size_t l = 1; l < lists.size() && !ids.empty(); l++)
+        {
+            // checking a handful of names is cheaper than walking a long list
+            if (uint64_t(ids.size()) * 16 < lists[l]->count)
+            {
+                break;
+            }
+
+            size_t in = 0;
+            size_t out = 0;
+            _decode(*lists[l], [&](uint32_t id) {
+                while (in < ids.size() && ids[in] < id)
+                {
+                    in++;
+                }
+                if (in == ids.size())
+                {
+                    return false;
+                }
+                if (ids[in] == id)
+                {
+                    ids[out++] = id;
+                    in++;
+                }
+                return true;
+            });
+            ids.resize(out);
+        }
+
+        return true;
+    }
+
+    bool built() const
+    {
+        return _built;
+    }
+
+    // records covered, ids from here on were added later
+    uint32_t records() const
+    {
+        return _records;
+    }
+
+    size_t trigrams() const
+    {
+        return _postings.size();
+    }
+
+    // bytes held by the index
+    size_t memory() const
+    {
+        return _table.capacity() * sizeof(uint32_t) + _postings.capacity() * sizeof(Posting) + _data.capacity();
+    }
+
+    void clear()
+    {
+        std::vector<uint32_t>().swap(_table);
+        std::vector<Posting>().swap(_postings);
+        std::vector<uint8_t>().swap(_data);
+        _records = 0;
+        _built = false;
+    }
+
+private:
+    static const uint32_t NOT_FOUND = 0xffffffff;
+
+    struct Posting
+    {
+        uint64_t key;
+        uint64_t offset; // into _data
+        uint32_t bytes;
+        uint32_t count;
+        uint32_t written; // while building
+    };
+
+    // distinct trigrams of a name, false if it has none
+    static bool _trigrams(wchar_t const *name, uint32_t length, std::vector<uint64_t> &grams)
+    {
+        grams.clear();
+        if (length < 3)
+        {
+            return false;
+        }
+
+        uint64_t key = (uint64_t(uint16_t(name[0])) << 16) | uint16_t(name[1]);
+        for (uint32_t i = 2; i < length; i++)
+        {
+            key = ((key << 16) | uint16_t(name[i])) & 0xffffffffffffull;
+            grams.push_back(key);
+        }
+
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        return true;
+    }
+
+    static uint32_t _hash(uint64_t key)
+    {
+        key *= 0x9e3779b97f4a7c15ull;
+        return uint32_t(key >> 32);
+    }
+
+    uint32_t _find(uint64_t key) const
+    {
+        if (_table.empty())
+        {
+            return NOT_FOUND;
+        }
+
+        uint32_t mask = uint32_t(_table.size() - 1);
+        for (uint32_t i = _hash(key) & mask;; i = (i + 1) & mask)
+        {
+            uint32_t entry = _table[i];
+            if (entry == 0)
+            {
+                return NOT_FOUND;
+            }
+            if (_postings[entry - 1].key == key)
+            {
+                return entry - 1;
+            }
+        }
+    }
+
+    uint32_t _add(uint64_t key)
+    {
+        uint32_t mask = uint32_t(_table.size() - 1);
+        uint32_t i = _hash(key) & mask;
+
+        for (;; i = (i + 1) & mask)
+        {
+            uint32_t entry = _table[i];
+            if (entry == 0)
+            {
+                break;
+            }
+            if (_postings[entry - 1].key == key)
+            {
+                return entry - 1;
+            }
+        }
+
+        _postings.push_back({key, 0, 0, 0, 0});
+        _table[i] = uint32_t(_postings.size());
+
+        if (_postings.size() * 2 > _table.size())
+        {
+            _grow();
+        }
+
+        return uint32_t(_postings.size() - 1);
+    }
+
+    void _grow()
+    {
+        _table.assign(_table.size() * 2, 0);
+        uint32_t mask = uint32_t(_table.size() - 1);
+
+        for (uint32_t slot = 0; slot < _postings.size(); slot++)
+        {
+            uint32_t i = _hash(_postings[slot].key) & mask;
+            while (_table[i] != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            _table[i] = slot + 1;
+        }
+    }
+
+    static uint32_t _varintSize(uint32_t value)
+    {
+        uint32_t size = 1;
+        while (value >= 0x80)
+        {
+            value >>= 7;
+            size++;
+        }
+        return size;
+    }
+
+    static void _writeVarint(uint8_t *out, uint32_t value, uint32_t *written)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = uint8_t(value | 0x80);
+            value >>= 7;
+            (*written)++;
+        }
+        *out = uint8_t(value);
+        (*written)++;
+    }
+
+    // calls visit with every id of a list until it returns false
+    template <class _Visit> void _decode(Posting const &posting, _Visit visit) const
+    {
+        uint8_t const *p = _data.data() + posting.offset;
+        uint32_t id = 0;
+
+        for (uint32_t n = 0; n < posting.count; n++)
+        {
+            uint32_t delta = 0;
+            uint32_t shift = 0;
+            while (*p & 0x80)
+            {
+                delta |= uint32_t(*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            delta |= uint32_t(*p++) << shift;
+
+            id += delta;
+            if (!visit(id))
+            {
+                return;
+            }
+        }
+    }
+
+    std::vector<uint32_t> _table; // slot + 1, 0 for empty
+    std::vector<Posting> _postings;
+    std::vector<uint8_t> _data;
+    uint32_t _records = 0;
+    bool _built = false;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <string>
+
+#if (defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)) && WCHAR_MAX == 0xffff
+#include <emmintrin.h>
+#define UTF8_SSE2 1
+#endif
+
+// UTF-16 <-> UTF-8 for file names and paths.
+// NTFS names are not guaranteed to be valid UTF-16, an unpaired surrogate is written as
+// U+FFFD instead of failing. Nothing here throws or allocates unless given a std::string.
+
+// bytes needed in the worst case for length wchar_t units
+inline size_t utf8Capacity(size_t length)
+{
+    return length * (WCHAR_MAX == 0xffff ? 3 : 4);
+}
+
+// encodes length units into out, which must hold utf8Capacity(length) bytes; returns the
+// number of bytes written, no terminating zero is added
+inline size_t encodeUtf8(wchar_t const *text, size_t length, char *out)
+{
+    uint8_t *dst = (uint8_t *)out;
+    size_t i = 0;
+
+    while (i < length)
+    {
+#ifdef UTF8_SSE2
+        // runs of ASCII, 16 units at a time
+        while (i + 16 <= length)
+        {
+            __m128i a = _mm_loadu_si128((__m128i const *)(text + i));
+            __m128i b = _mm_loadu_si128((__m128i const *)(text + i + 8));
+            __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xff80));
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+            {
+                break;
+            }
+
+            _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+            dst += 16;
+            i += 16;
+        }
+#endif
+        while (i < length && text[i] < 0x80)
+        {
+            *dst++ = uint8_t(text[i++]);
+#ifdef UTF8_SSE2
+            if ((i & 15) == 0)
+            {
+                break;
+            }
+#endif
+        }
+
+        if (i >= length)
+        {
+            break;
+        }
+
+        uint32_t c = uint32_t(text[i++]);
+
+        if (c < 0x80)
+        {
+            *dst++ = uint8_t(c);
+        }
+        else if (c < 0x800)
+        {
+            *dst++ = uint8_t(0xc0 | (c >> 6));
+            *dst++ = uint8_t(0x80 | (c & 0x3f));
+        }
+        else if (c >= 0xd800 && c <= 0xdfff)
+        {
+            uint32_t low = (i < length) ? uint32_t(text[i]) : 0;
+
+            if (c <= 0xdbff && low >= 0xdc00 && low <= 0xdfff)
+            {
+                i++;
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+
+                *dst++ = uint8_t(0xf0 | (c >> 18));
+                *dst++ = uint8_t(0x80 | ((c >> 12) & 0x3f));
+                *dst++ = uint8_t(0x80 | ((c >> 6) & 0x3f));
+                *dst++ = uint8_t(0x80 | (c & 0x3f));
+            }
+            else
+            {
+                // unpaired surrogate
+                *dst++ = 0xef;
+                *dst++ = 0xbf;
+                *dst++ = 0xbd;
+            }
+        }
+        else if (c >= 0x10000 && c <= 0x10ffff)
+        {
+            // 32 bit wchar_t
+            *dst++ = uint8_t(0xf0 | (c >> 18));
+            *dst++ = uint8_t(0x80 | ((c >> 12) & 0x3f));
+            *dst++ = uint8_t(0x80 | ((c >> 6) & 0x3f));
+            *dst++ = uint8_t(0x80 | (c & 0x3f));
+        }
+        else if (c > 0x10ffff)
+        {
+            *dst++ = 0xef;
+            *dst++ = 0xbf;
+            *dst++ = 0xbd;
+        }
+        else
+        {
+            *dst++ = uint8_t(0xe0 | (c >> 12));
+            *dst++ = uint8_t(0x80 | ((c >> 6) & 0x3f));
+            *dst++ = uint8_t(0x80 | (c & 0x3f));
+        }
+    }
+
+    return size_t((char *)dst - out);
+}
+
+inline void appendUtf8(std::string &out, wchar_t const *text, size_t length)
+{
+    size_t used = out.size();
+    out.resize(used + utf8Capacity(length));
+    out.resize(used + encodeUtf8(text, length, &out[used]));
+}
+
+// decodes UTF-8 into UTF-16, malformed bytes become U+FFFD
+inline std::wstring decodeUtf8(char const *text, size_t length)
+{
+    std::wstring out;
+    out.reserve(length);
+
+    uint8_t const *src = (uint8_t const *)text;
+    uint8_t const *end = src + length;
+
+    while (src < end)
+    {
+        uint32_t c = *src++;
+
+        if (c < 0x80)
+        {
+            out.push_back(wchar_t(c));
+            continue;
+        }
+
+        int extra = (c >= 0xf0 && c < 0xf8) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc2 && c < 0xe0) ? 1 : -1;
+        if (c >= 0xf8)
+        {
+            extra = -1;
+        }
+
+        if (extra < 0 || end - src < extra)
+        {
+            out.push_back(wchar_t(0xfffd));
+            continue;
+        }
+
+        c &= (0x3f >> extra);
+
+        bool valid = true;
+        for (int n = 0; n < extra; n++)
+        {
+            if ((src[n] & 0xc0) != 0x80)
+            {
+                valid = false;
+                break;
+            }
+            c = (c << 6) | (src[n] & 0x3f);
+        }
+
+        if (!valid || (extra == 2 && (c < 0x800 || (c >= 0xd800 && c <= 0xdfff))) ||
+            (extra == 3 && (c < 0x10000 || c > 0x10ffff)))
+        {
+            out.push_back(wchar_t(0xfffd));
+            continue;
+        }
+
+        src += extra;
+
+        if (c >= 0x10000 && WCHAR_MAX == 0xffff)
+        {
+            c -= 0x10000;
+            out.push_back(wchar_t(0xd800 + (c >> 10)));
+            out.push_back(wchar_t(0xdc00 + (c & 0x3ff)));
+        }
+        else
+        {
+            out.push_back(wchar_t(c));
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,636 @@
+#include "VolumeSource.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+// Fallback queue: each read is issued when it is collected, so at most one is in flight.
+
+class SyncReadQueue : public AsyncReadQueue
+{
+public:
+    SyncReadQueue(VolumeSource *source, uint32_t depth) : _source(source), _slots(depth ? depth : 1)
+    {
+    }
+
+    bool submit(uint64_t offset, void *buffer, uint32_t size) override
+    {
+        if (_pending == _slots.size())
+        {
+            return false;
+        }
+
+        Slot &slot = _slots[(_first + _pending) % _slots.size()];
+        slot.offset = offset;
+        slot.buffer = buffer;
+        slot.size = size;
+        _pending++;
+        return true;
+    }
+
+    bool complete(void **buffer, uint32_t *bytesRead) override
+    {
+        if (_pending == 0)
+        {
+            return false;
+        }
+
+        Slot &slot = _slots[_first];
+        _first = (_first + 1) % _slots.size();
+        _pending--;
+
+        *buffer = slot.buffer;
+        return _source->read(slot.offset, slot.buffer, slot.size, bytesRead);
+    }
+
+    uint32_t pending() const override
+    {
+        return _pending;
+    }
+
+    uint32_t depth() const override
+    {
+        return uint32_t(_slots.size());
+    }
+
+private:
+    struct Slot
+    {
+        uint64_t offset = 0;
+        void *buffer = nullptr;
+        uint32_t size = 0;
+    };
+
+    VolumeSource *_source;
+    std::vector<Slot> _slots;
+    uint32_t _first = 0;
+    uint32_t _pending = 0;
+};
+
+AsyncReadQueue *VolumeSource::createReadQueue(uint32_t depth)
+{
+    return new SyncReadQueue(this, depth);
+}
+
+#ifdef _WIN32
+
+// Overlapped reads, one event per slot.
+
+class Win32ReadQueue : public AsyncReadQueue
+{
+public:
+    Win32ReadQueue(HANDLE handle, uint32_t depth) : _handle(handle), _slots(depth ? depth : 1)
+    {
+        for (auto &slot : _slots)
+        {
+            slot.event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        }
+    }
+
+    ~Win32ReadQueue() override
+    {
+        while (_pending)
+        {
+            Slot &slot = _slots[_first];
+            DWORD read;
+            CancelIoEx(_handle, &slot.overlapped);
+            GetOverlappedResult(_handle, &slot.overlapped, &read, TRUE);
+            _first = (_first + 1) % _slots.size();
+            _pending--;
+        }
+
+        for (auto &slot : _slots)
+        {
+            CloseHandle(slot.event);
+        }
+    }
+
+    bool submit(uint64_t offset, void *buffer, uint32_t size) override
+    {
+        if (_pending == _slots.size())
+        {
+            return false;
+        }
+
+        Slot &slot = _slots[(_first + _pending) % _slots.size()];
+
+        memset(&slot.overlapped, 0, sizeof(OVERLAPPED));
+        slot.overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+        slot.overlapped.OffsetHigh = DWORD(offset >> 32);
+        slot.overlapped.hEvent = slot.event;
+        ResetEvent(slot.event);
+
+        slot.buffer = buffer;
+        slot.error = 0;
+
+        if (!ReadFile(_handle, buffer, size, nullptr, &slot.overlapped))
+        {
+            DWORD error = GetLastError();
+            if (error != ERROR_IO_PENDING)
+            {
+                // still queued, so the failure is reported in order by complete()
+                slot.error = error;
+            }
+        }
+
+        _pending++;
+        return true;
+    }
+
+    bool complete(void **buffer, uint32_t *bytesRead) override
+    {
+        if (_pending == 0)
+        {
+            return false;
+        }
+
+        Slot &slot = _slots[_first];
+        _first = (_first + 1) % _slots.size();
+        _pending--;
+
+        *buffer = slot.buffer;
+        *bytesRead = 0;
+
+        if (slot.error != 0)
+        {
+            return slot.error == ERROR_HANDLE_EOF;
+        }
+
+        DWORD read = 0;
+        BOOL ok = GetOverlappedResult(_handle, &slot.overlapped, &read, TRUE);
+        *bytesRead = read;
+
+        return ok || (GetLastError() == ERROR_HANDLE_EOF);
+    }
+
+    uint32_t pending() const override
+    {
+        return _pending;
+    }
+
+    uint32_t depth() const override
+    {
+        return uint32_t(_slots.size());
+    }
+
+private:
+    struct Slot
+    {
+        OVERLAPPED overlapped;
+        HANDLE event = nullptr;
+        void *buffer = nullptr;
+        DWORD error = 0;
+    };
+
+    HANDLE _handle;
+    std::vector<Slot> _slots;
+    uint32_t _first = 0;
+    uint32_t _pending = 0;
+};
+
+Win32VolumeSource::Win32VolumeSource(HANDLE handle, bool liveVolume) : _handle(handle), _liveVolume(liveVolume)
+{
+}
+
+Win32VolumeSource::~Win32VolumeSource()
+{
+    if (_handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(_handle);
+    }
+}
+
+Win32VolumeSource *Win32VolumeSource::open(wchar_t const *path)
+{
+    // \\.\C: is a volume, anything else is treated as an image file
+    size_t len = wcslen(path);
+    bool liveVolume = (len == 6) && (wcsncmp(path, L"\\\\.\\", 4) == 0) && (path[5] == L':');
+
+    DWORD flags = FILE_FLAG_OVERLAPPED;
+    if (!liveVolume)
+    {
+        flags |= FILE_FLAG_SEQUENTIAL_SCAN;
+    }
+
+    HANDLE handle =
+        CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, flags, nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return nullptr;
+    }
+
+    return new Win32VolumeSource(handle, liveVolume);
+}
+
+bool Win32VolumeSource::read(uint64_t offset, void *buffer, uint32_t size, uint32_t *bytesRead)
+{
+    // positional read, the handle has no shared file pointer state
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.Offset = DWORD(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = DWORD(offset >> 32);
+    overlapped.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+    DWORD read = 0;
+    BOOL ok = ReadFile(_handle, buffer, size, nullptr, &overlapped);
+    if (ok || GetLastError() == ERROR_IO_PENDING)
+    {
+        ok = GetOverlappedResult(_handle, &overlapped, &read, TRUE);
+    }
+
+    bool eof = !ok && (GetLastError() == ERROR_HANDLE_EOF);
+
+    CloseHandle(overlapped.hEvent);
+
+    *bytesRead = read;
+
+    return ok || eof;
+}
+
+uint64_t Win32VolumeSource::size() const
+{
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(_handle, &fileSize))
+    {
+        return fileSize.QuadPart;
+    }
+    return 0;
+}
+
+AsyncReadQueue *Win32VolumeSource::createReadQueue(uint32_t depth)
+{
+    return new Win32ReadQueue(_handle, depth);
+}
+
+VolumeSource *openVolumeSource(std::string const &path)
+{
+    int n = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    if (n <= 0)
+    {
+        return nullptr;
+    }
+
+    std::vector<wchar_t> widePath(n);
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, widePath.data(), n);
+
+    return Win32VolumeSource::open(widePath.data());
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// io_uring driven directly through the system calls, no liburing dependency.
+// Completions arrive in any order; each slot records its result until complete() reaches it.
+
+class UringReadQueue : public AsyncReadQueue
+{
+public:
+    UringReadQueue(PosixVolumeSource *source, uint32_t depth) : _source(source), _slots(depth ? depth : 1)
+    {
+    }
+
+    ~UringReadQueue() override
+    {
+        void *buffer;
+        uint32_t read;
+        while (_pending)
+        {
+            complete(&buffer, &read);
+        }
+
+        if (_sqes != MAP_FAILED && _sqes != nullptr)
+        {
+            munmap(_sqes, _sqesSize);
+        }
+        if (_cqRing != _sqRing && _cqRing != MAP_FAILED && _cqRing != nullptr)
+        {
+            munmap(_cqRing, _cqRingSize);
+        }
+        if (_sqRing != MAP_FAILED && _sqRing != nullptr)
+        {
+            munmap(_sqRing, _sqRingSize);
+        }
+        if (_ring >= 0)
+        {
+            close(_ring);
+        }
+    }
+
+    bool setup()
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(io_uring_params));
+
+        _ring = int(syscall(__NR_io_uring_setup, uint32_t(_slots.size()), &params));
+        if (_ring < 0)
+        {
+            return false;
+        }
+
+        _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap)
+        {
+            _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+        }
+
+        _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring,
+                       IORING_OFF_SQ_RING);
+        if (_sqRing == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _cqRing = singleMap ? _sqRing
+                            : mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring,
+                                   IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+        if (_sqes == MAP_FAILED)
+        {
+            return false;
+        }
+
+        uint8_t *sq = (uint8_t *)_sqRing;
+        _sqTail = (uint32_t *)(sq + params.sq_off.tail);
+        _sqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+        _sqArray = (uint32_t *)(sq + params.sq_off.array);
+
+        uint8_t *cq = (uint8_t *)_cqRing;
+        _cqHead = (uint32_t *)(cq + params.cq_off.head);
+        _cqTail = (uint32_t *)(cq + params.cq_off.tail);
+        _cqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+        _cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        return true;
+    }
+
+    bool submit(uint64_t offset, void *buffer, uint32_t size) override
+    {
+        if (_pending == _slots.size())
+        {
+            return false;
+        }
+
+        uint32_t index = (_first + _pending) % uint32_t(_slots.size());
+
+        Slot &slot = _slots[index];
+        slot.offset = offset;
+        slot.buffer = buffer;
+        slot.size = size;
+        slot.result = 0;
+        slot.done = false;
+
+        uint32_t tail = *_sqTail;
+        uint32_t sqIndex = tail & _sqMask;
+
+        io_uring_sqe *sqe = (io_uring_sqe *)_sqes + sqIndex;
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = _source->fd();
+        sqe->off = offset;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = size;
+        sqe->user_data = index;
+
+        _sqArray[sqIndex] = sqIndex;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, _ring, 1, 0, 0, nullptr, 0) < 0)
+        {
+            // the entry was not consumed, take it back and fail this read in order
+            __atomic_store_n(_sqTail, tail, __ATOMIC_RELEASE);
+            slot.result = -errno;
+            slot.done = true;
+        }
+
+        _pending++;
+        return true;
+    }
+
+    bool complete(void **buffer, uint32_t *bytesRead) override
+    {
+        if (_pending == 0)
+        {
+            return false;
+        }
+
+        Slot &slot = _slots[_first];
+
+        while (!slot.done)
+        {
+            uint32_t head = *_cqHead;
+            if (head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+            {
+                if (syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                    errno != EINTR)
+                {
+                    slot.result = -errno;
+                    slot.done = true;
+                }
+                continue;
+            }
+
+            io_uring_cqe &cqe = _cqes[head & _cqMask];
+            Slot &finished = _slots[cqe.user_data];
+            finished.result = cqe.res;
+            finished.done = true;
+
+            __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+        }
+
+        _first = (_first + 1) % uint32_t(_slots.size());
+        _pending--;
+
+        *buffer = slot.buffer;
+        *bytesRead = 0;
+
+        if (slot.result < 0)
+        {
+            return false;
+        }
+
+        uint32_t read = uint32_t(slot.result);
+        if (read < slot.size && read > 0)
+        {
+            // short read in the middle of a device, finish it synchronously
+            uint32_t rest = 0;
+            _source->read(slot.offset + read, (uint8_t *)slot.buffer + read, slot.size - read, &rest);
+            read += rest;
+        }
+
+        *bytesRead = read;
+        return true;
+    }
+
+    uint32_t pending() const override
+    {
+        return _pending;
+    }
+
+    uint32_t depth() const override
+    {
+        return uint32_t(_slots.size());
+    }
+
+private:
+    struct Slot
+    {
+        uint64_t offset = 0;
+        void *buffer = nullptr;
+        uint32_t size = 0;
+        int32_t result = 0;
+        bool done = false;
+    };
+
+    PosixVolumeSource *_source;
+    std::vector<Slot> _slots;
+    uint32_t _first = 0;
+    uint32_t _pending = 0;
+
+    int _ring = -1;
+    void *_sqRing = nullptr;
+    void *_cqRing = nullptr;
+    void *_sqes = nullptr;
+    size_t _sqRingSize = 0;
+    size_t _cqRingSize = 0;
+    size_t _sqesSize = 0;
+
+    uint32_t *_sqTail = nullptr;
+    uint32_t *_sqArray = nullptr;
+    uint32_t _sqMask = 0;
+
+    uint32_t *_cqHead = nullptr;
+    uint32_t *_cqTail = nullptr;
+    uint32_t _cqMask = 0;
+    io_uring_cqe *_cqes = nullptr;
+};
+
+#endif
+
+PosixVolumeSource::PosixVolumeSource(int fd) : _fd(fd)
+{
+}
+
+PosixVolumeSource::~PosixVolumeSource()
+{
+    if (_fd >= 0)
+    {
+        close(_fd);
+    }
+}
+
+PosixVolumeSource *PosixVolumeSource::open(char const *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    return new PosixVolumeSource(fd);
+}
+
+bool PosixVolumeSource::read(uint64_t offset, void *buffer, uint32_t size, uint32_t *bytesRead)
+{
+    uint32_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t n = pread(_fd, (uint8_t *)buffer + done, size - done, off_t(offset + done));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            *bytesRead = done;
+            return false;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        done += uint32_t(n);
+    }
+
+    *bytesRead = done;
+    return true;
+}
+
+uint64_t PosixVolumeSource::size() const
+{
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+    {
+        return 0;
+    }
+
+#ifdef BLKGETSIZE64
+    if (S_ISBLK(st.st_mode))
+    {
+        uint64_t bytes = 0;
+        if (ioctl(_fd, BLKGETSIZE64, &bytes) == 0)
+        {
+            return bytes;
+        }
+        return 0;
+    }
+#endif
+
+    return uint64_t(st.st_size);
+}
+
+AsyncReadQueue *PosixVolumeSource::createReadQueue(uint32_t depth)
+{
+#ifdef HAVE_IO_URING
+    UringReadQueue *queue = new UringReadQueue(this, depth);
+    if (queue->setup())
+    {
+        return queue;
+    }
+    delete queue;
+#endif
+
+    return VolumeSource::createReadQueue(depth);
+}
+
+VolumeSource *openVolumeSource(std::string const &path)
+{
+    return PosixVolumeSource::open(path.c_str());
+}
+
+#endif
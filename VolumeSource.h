@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+class AsyncReadQueue;
+
+// Positional reader for the raw bytes of an NTFS volume.
+// The scanner only asks for (offset, size) reads, so the same parser runs against a live
+// drive, a raw image file or a block device.
+
+class VolumeSource
+{
+public:
+    virtual ~VolumeSource()
+    {
+    }
+
+    // read size bytes at the absolute byte offset; bytesRead may be short at the end of the volume
+    virtual bool read(uint64_t offset, void *buffer, uint32_t size, uint32_t *bytesRead) = 0;
+
+    // total size in bytes, 0 if unknown
+    virtual uint64_t size() const = 0;
+
+    // true for \\.\X: style devices, which need sector aligned reads
+    virtual bool isLiveVolume() const = 0;
+
+    // queue that keeps up to depth reads in flight; the default one reads synchronously
+    virtual AsyncReadQueue *createReadQueue(uint32_t depth);
+};
+
+// Reads submitted to the queue run concurrently, but complete() hands them back in
+// submission order, so the MFT parser still sees its buffers in VCN order.
+
+class AsyncReadQueue
+{
+public:
+    virtual ~AsyncReadQueue()
+    {
+    }
+
+    // fails if depth() reads are already outstanding
+    virtual bool submit(uint64_t offset, void *buffer, uint32_t size) = 0;
+
+    // waits for the oldest outstanding read
+    virtual bool complete(void **buffer, uint32_t *bytesRead) = 0;
+
+    virtual uint32_t pending() const = 0;
+    virtual uint32_t depth() const = 0;
+};
+
+#ifdef _WIN32
+
+class Win32VolumeSource : public VolumeSource
+{
+public:
+    Win32VolumeSource(HANDLE handle, bool liveVolume);
+    ~Win32VolumeSource() override;
+
+    // the handle is opened for overlapped I/O
+    static Win32VolumeSource *open(wchar_t const *path);
+
+    bool read(uint64_t offset, void *buffer, uint32_t size, uint32_t *bytesRead) override;
+    uint64_t size() const override;
+    bool isLiveVolume() const override
+    {
+        return _liveVolume;
+    }
+
+    AsyncReadQueue *createReadQueue(uint32_t depth) override;
+
+    HANDLE handle() const
+    {
+        return _handle;
+    }
+
+private:
+    HANDLE _handle = INVALID_HANDLE_VALUE;
+    bool _liveVolume = false;
+};
+
+#else
+
+// image files and /dev/sdX partitions
+class PosixVolumeSource : public VolumeSource
+{
+public:
+    explicit PosixVolumeSource(int fd);
+    ~PosixVolumeSource() override;
+
+    static PosixVolumeSource *open(char const *path);
+
+    bool read(uint64_t offset, void *buffer, uint32_t size, uint32_t *bytesRead) override;
+    uint64_t size() const override;
+    bool isLiveVolume() const override
+    {
+        return false;
+    }
+
+    // io_uring on Linux, falls back to synchronous reads when it is unavailable
+    AsyncReadQueue *createReadQueue(uint32_t depth) override;
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+private:
+    int _fd = -1;
+};
+
+#endif
+
+// Opens a live volume (\\.\C:), an image file or a block device. path is UTF-8.
+// Returns nullptr on failure.
+VolumeSource *openVolumeSource(std::string const &path);
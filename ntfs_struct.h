@@ -8,13 +8,21 @@
 // https://docs.microsoft.com/en-us/windows/win32/api/winioctl/ni-winioctl-fsctl_get_ntfs_volume_data
 // https://docs.microsoft.com/en-us/windows/win32/api/ioapiset/nf-ioapiset-deviceiocontrol
 
+#include <atomic>
 #include <string>
 #include <unordered_map>
 #include <memory>
+#include <vector>
 #include <windows.h>
 #include <winioctl.h>
 
 #include "AttributeType.h"
+#include "ExtensionTable.h"
+#include "TrigramIndex.h"
+#include "MappedVector.h"
+#include "NameArena.h"
+#include "Snapshot.h"
+#include "VolumeSource.h"
 #include "ntfs.h"
 
 #pragma pack(push)
@@ -150,24 +158,77 @@ struct FileInformation
     uint32_t objAttrib = 0;
 };
 
-struct LongFileInfo
+// the part of a record every search reads, indexed by record number
+struct FileEntry
 {
-    wchar_t const *fileName = nullptr;
-    uint16_t fileNameLength = 0;
-    uint16_t flags = 0;
-    FILE_REFERENCE parentId;
+    uint32_t nameOffset = 0; // into DiskHandle::names
+    uint32_t parent = 0;     // record number of the parent directory
+    uint16_t nameLength = 0; // 0 if the record has no name
+    uint16_t flags = 0;      // IN_USE, IS_DIRECTORY
+};
 
+// state of a record at the last scan, a record that was written since has a newer LSN
+// and one that was freed and reused a new sequence number
+#pragma pack(push)
+#pragma pack(4)
+struct RecordStamp
+{
+    uint64_t lsn = 0;
+    uint16_t sequenceNumber = 0;
+    uint16_t reserved = 0;
+};
+#pragma pack(pop)
+
+// record numbers touched by the last reload of a disk, each sorted; a reused record is
+// both removed and added
+struct RecordChanges
+{
+    std::vector<uint32_t> added;
+    std::vector<uint32_t> removed;
+    std::vector<uint32_t> modified;
+
+    void clear()
+    {
+        added.clear();
+        removed.clear();
+        modified.clear();
+    }
+};
+
+#define FIXUP_IN_USE 1 // the extension record is in use
+#define FIXUP_SIZE 2   // it holds the first extent of the unnamed $DATA
+
+// where the scan of one disk is, read by the thread reporting the progress of several
+struct ScanProgress
+{
+    std::atomic<uint64_t> done{0};
+    std::atomic<uint64_t> total{0};
+};
+
+// what an extension record holds for its base record
+struct Fixup
+{
+    uint32_t base = 0;
+    uint32_t extension = 0;  // the extension record
+    uint32_t nameOffset = 0; // into DiskHandle::names
+    uint32_t parent = 0;
+    uint16_t nameLength = 0; // 0 if the record has no usable name
+    uint16_t flags = 0;      // FIXUP_*
     uint64_t fileSize = 0;
-    int64_t *userData = 0;
-    void *extraData = nullptr;
+    uint64_t allocatedFileSize = 0;
+};
 
-    FILETIME creationTime;
-    FILETIME accessTime;
-    FILETIME writeTime;
-    FILETIME changeTime;
+// sizes and times, only kept when file details are collected
+struct LongFileInfo
+{
+    uint64_t fileSize = 0;
     uint64_t allocatedFileSize = 0;
+
+    FILETIME creationTime = {};
+    FILETIME accessTime = {};
+    FILETIME writeTime = {};
+    FILETIME changeTime = {};
     uint32_t fileAttributes = 0;
-    uint32_t attributes = 0;
 };
 
 #pragma pack(push)
@@ -183,17 +244,90 @@ public:
     DiskHandle()
     {
     }
-    HANDLE fileHandle = 0;
+    VolumeSource *source = nullptr;
     uint32_t type = 0;
 
     uint32_t filesSize = 0;
     uint32_t realFiles = 0;
     wchar_t dosDevice = 0;
 
+    // slot in NTFSDirectorySystem::disks
+    int drive = 0;
+
+    // drive root or image path, used in progress text
+    std::string label;
+
     // place to store name to point to
-    std::vector<std::shared_ptr<wchar_t>> nameInfo;
+    NameArena names;
+
+    // names written by journal replay
+    NameArena::Cursor replayNames{&names};
+
+    // $UpCase of the volume, 64K entries, read with the first load; upcaseHash tells
+    // volumes with the same table apart from others
+    std::vector<wchar_t> upcase;
+    uint64_t upcaseHash = 0;
+
+    // names mapped through upcase, kept while the system is case insensitive
+    FoldedNames foldedNames;
+
+    MappedVector<FileEntry> files;
+
+    // one per record when file details are collected, otherwise empty
+    MappedVector<LongFileInfo> details;
+
+    // one per record with incremental rescans enabled, otherwise empty
+    std::vector<RecordStamp> stamps;
+
+    // extension record fixups of the running scan, sorted by base record
+    std::vector<Fixup> fixups;
+
+    // what the last journal replay or incremental rescan changed
+    RecordChanges changes;
+
+    // set while the disk is scanned together with others
+    ScanProgress *progress = nullptr;
+
+    // directory record -> its path with a trailing backslash, filled by _path, cleared on reparse
+    std::unordered_map<uint32_t, std::wstring> pathCache;
+
+    // extension slot -> files with it in record order, built while parsing
+    ExtensionTable extensions;
+    std::vector<MappedVector<uint32_t>> extensionFiles;
+
+    // trigrams of the names searches compare, built after a load when enabled; records
+    // added or modified by later reloads are kept sorted in trigramsPending and always checked
+    TrigramIndex trigrams;
+    std::vector<uint32_t> trigramsPending;
+
+    // set when the tables above are views into a loaded snapshot
+    std::unique_ptr<MappedFile> snapshot;
+
+    // $UsnJrnl record, and how far its changes are reflected in the tables; journalId 0
+    // means there is nothing to replay from
+    uint32_t usnJournalRecord = 0;
+    uint64_t usnJournalId = 0;
+    uint64_t usnCursor = 0;
+
+    // one bit per directory record at or below a blacklisted directory
+    std::vector<uint64_t> excluded;
+    uint32_t excludedVersion = 0;
+
+    wchar_t const *name(FileEntry const &entry) const
+    {
+        return names.at(entry.nameOffset);
+    }
 
-    std::vector<LongFileInfo> fileInfo;
+    wchar_t const *foldedName(FileEntry const &entry) const
+    {
+        return foldedNames.at(entry.nameOffset);
+    }
+
+    // $MFT:$BITMAP, one bit per record in use
+    std::vector<uint8_t> mftBitmap;
+
+    // parse free records as well, for deleted file searches
+    bool scanDeleted = false;
 
     union
     {
@@ -217,14 +351,142 @@ public:
     PACKED_BOOT_SECTOR bootBlock;
 };
 
+// one read of the MFT data stream
+struct MFTChunk
+{
+    uint64_t offset = 0; // byte offset on the volume, 0 for a sparse run
+    uint32_t size = 0;
+    uint32_t firstRecord = 0;
+};
+
+// a completed read handed from the reader thread to the parser
+struct MFTBuffer
+{
+    MFTChunk const *chunk = nullptr;
+    uint8_t *data = nullptr;
+    uint32_t read = 0;
+};
+
 typedef uint32_t(__cdecl *FetchProcedure)(DiskHandle *, FILE_RECORD_SEGMENT_HEADER *, uint8_t *);
 
 // limit: 2^32 files
 
-// LinkedList
-struct LinkItem
+// a record extracted again by an incremental rescan
+struct ReplacedRecord
+{
+    uint32_t id = 0;
+    bool reused = false; // sequence number changed, the record holds a different file
+    FileEntry previous;
+};
+
+// state owned by one parser thread, merged into the disk when the scan is finished
+struct ParseContext
+{
+    NameArena::Cursor names;
+    uint32_t realFiles = 0;
+
+    // extension records seen by this thread, applied to their bases after the scan
+    std::vector<Fixup> fixups;
+
+    // this thread's part of DiskHandle::extensionFiles
+    ExtensionTable extensions;
+    std::vector<std::vector<uint32_t>> extensionFiles;
+
+    // incremental rescan: records whose stamp changed, with their entries before
+    bool rescan = false;
+    std::vector<ReplacedRecord> replaced;
+};
+
+// read buffer shared by the parser threads, returned to the reader by the last one
+struct SharedBuffer
+{
+    uint8_t *data = nullptr;
+    std::atomic<uint32_t> remaining;
+};
+
+// a slice of whole records from a shared buffer
+struct ParseRange
+{
+    SharedBuffer *owner = nullptr;
+    uint8_t *data = nullptr;
+    uint32_t size = 0;
+    uint32_t firstRecord = 0;
+};
+
+#ifndef USN_REASON_FILE_CREATE
+#define USN_REASON_FILE_CREATE 0x00000100
+#define USN_REASON_FILE_DELETE 0x00000200
+#define USN_REASON_RENAME_OLD_NAME 0x00001000
+#define USN_REASON_RENAME_NEW_NAME 0x00002000
+#endif
+
+// the parts of $Extend\$UsnJrnl needed to replay it
+struct UsnJournal
+{
+    uint32_t record = 0;
+    uint64_t journalId = 0;
+    uint64_t lowestValidUsn = 0;
+    uint64_t nextUsn = 0; // size of the $J stream
+};
+
+#pragma pack(push)
+#pragma pack(1)
+
+// $UsnJrnl:$Max
+struct UsnJournalMax
+{
+    uint64_t maximumSize;
+    uint64_t allocationDelta;
+    uint64_t journalId;
+    int64_t lowestValidUsn;
+};
+
+// start of every record in $UsnJrnl:$J
+struct UsnRecordHeader
+{
+    uint32_t recordLength;
+    uint16_t majorVersion;
+    uint16_t minorVersion;
+};
+
+struct UsnRecordV2 : public UsnRecordHeader
+{
+    uint64_t fileReferenceNumber;
+    uint64_t parentFileReferenceNumber;
+    int64_t usn;
+    int64_t timeStamp;
+    uint32_t reason;
+    uint32_t sourceInfo;
+    uint32_t securityId;
+    uint32_t fileAttributes;
+    uint16_t fileNameLength; // bytes
+    uint16_t fileNameOffset;
+};
+
+// 128 bit file ids, NTFS keeps its file reference in the low half
+struct UsnRecordV3 : public UsnRecordHeader
+{
+    uint64_t fileReferenceNumber[2];
+    uint64_t parentFileReferenceNumber[2];
+    int64_t usn;
+    int64_t timeStamp;
+    uint32_t reason;
+    uint32_t sourceInfo;
+    uint32_t securityId;
+    uint32_t fileAttributes;
+    uint16_t fileNameLength; // bytes
+    uint16_t fileNameOffset;
+};
+
+#pragma pack(pop)
+
+// a journal record read by a replay, applied once the whole range has been read
+struct UsnChange
 {
-    unsigned int data;
-    unsigned int entry;
-    LinkItem *next;
+    uint32_t id;
+    uint32_t parent;
+    uint32_t reason;
+    uint32_t attributes;
+    uint32_t nameOffset; // into the names read with it
+    uint32_t nameLength;
 };